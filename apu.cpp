@@ -26,6 +26,8 @@ static enum OAM_DMA_state {
     OAM_DMA_NOT_IN_PROGRESS
 } oam_dma_state;
 
+static bool dmc_sample_load_possible();
+
 void do_oam_dma(uint8_t addr) {
     // We get either WDTTT... or WDDTTT... where W is the write cycle, D a
     // dummy cycle, and T a transfer cycle (there's 512 of them). The extra
@@ -40,6 +42,24 @@ void do_oam_dma(uint8_t addr) {
     if (!apu_clk1_is_high) tick();
     tick();
 
+    // Fast path for the common case. If the page can be read without side
+    // effects, no DMC sample load can interfere with the transfer timing, and
+    // the PPU won't look at OAM during the transfer, then all the reads and
+    // writes can be done in one go after the transfer cycles. Sprite-heavy
+    // games do OAM DMA every frame.
+    //
+    // 4 dots per cycle is an upper bound for PAL, which has 3.2.
+    uint8_t const *const page = get_side_effect_free_page(addr);
+    if (page && !dmc_sample_load_possible() && oam_idle_for_dots(4*512)) {
+        for (unsigned i = 0; i < 512; ++i)
+            tick();
+        write_oam_page(page);
+        cpu_data_bus = page[255];
+        cpu_is_reading = true;
+        oam_dma_state = OAM_DMA_NOT_IN_PROGRESS;
+        return;
+    }
+
     unsigned const start_addr = 0x100*addr;
     for (size_t i = 0; i < 254; ++i) {
         // Do it like this to get open bus right. Could be that it's not
@@ -63,6 +83,23 @@ void do_oam_dma(uint8_t addr) {
     oam_dma_state = OAM_DMA_NOT_IN_PROGRESS;
 }
 
+//
+// Lazy synchronization
+//
+// The APU isn't run in lockstep with the CPU. tick_apu() only counts ticks,
+// and the APU catches up in sync_apu() when it needs to: on register
+// accesses, at frame boundaries, and at the predicted times of events that
+// are visible to the rest of the system (frame counter steps, which include
+// the frame IRQ, and DMC sample fetches, which steal CPU cycles and can
+// trigger the DMC IRQ). When catching up, stretches of ticks during which no
+// channel output changes are skipped over in bulk.
+
+// Number of CPU ticks the APU is behind
+static unsigned apu_lag;
+// apu_lag value at which the next event happens. Recalculated by sync_apu().
+static unsigned apu_event_lag;
+
+static void sync_for_reg_access();
 
 // Set when the output level of any channel changes. Lets us skip the mixing
 // step most of the time.
@@ -126,13 +163,21 @@ static void update_sweep_target_period(unsigned n) {
     pulse[n].sweep_target_period = (int)pulse[n].period + addition;
 }
 
-static void update_pulse_output_level(unsigned n) {
-    static uint8_t const pulse_duties[4][8] =
-      { { 0, 1, 0, 0, 0, 0, 0, 0 },
-        { 0, 1, 1, 0, 0, 0, 0, 0 },
-        { 0, 1, 1, 1, 1, 0, 0, 0 },
-        { 1, 0, 0, 1, 1, 1, 1, 1 } };
+static uint8_t const pulse_duties[4][8] =
+  { { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 } };
+
+// True if clocking the waveform generator can't change the output level
+static bool pulse_is_silent(unsigned n) {
+    return pulse[n].len_cnt == 0                  ||
+           pulse[n].period < 8                    ||
+           pulse[n].sweep_target_period > 0x7FF   ||
+           (pulse[n].const_vol ? pulse[n].vol : pulse[n].env_vol) == 0;
+}
 
+static void update_pulse_output_level(unsigned n) {
     unsigned const prev_output_level = pulse[n].output_level;
 
     if (pulse[n].len_cnt == 0                               ||
@@ -152,6 +197,8 @@ static void update_pulse_output_level(unsigned n) {
 
 // $4000/$4004
 void write_pulse_reg_0(unsigned n, uint8_t val) {
+    sync_for_reg_access();
+
     pulse[n].duty              = val >> 6;
     pulse[n].halt_len_loop_env = val & 0x20;
     pulse[n].const_vol         = val & 0x10;
@@ -162,6 +209,8 @@ void write_pulse_reg_0(unsigned n, uint8_t val) {
 
 // $4001/$4005
 void write_pulse_reg_1(unsigned n, uint8_t val) {
+    sync_for_reg_access();
+
     pulse[n].sweep_enabled = val & 0x80;
     pulse[n].sweep_period  = (val >> 4) & 7;
     pulse[n].sweep_negate  = val & 8;
@@ -175,6 +224,8 @@ void write_pulse_reg_1(unsigned n, uint8_t val) {
 
 // $4002/$4006
 void write_pulse_reg_2(unsigned n, uint8_t val) {
+    sync_for_reg_access();
+
     pulse[n].period = (pulse[n].period & ~0x0FF) | val;
 
     update_sweep_target_period(n);
@@ -183,6 +234,8 @@ void write_pulse_reg_2(unsigned n, uint8_t val) {
 
 // $4003/$4007
 void write_pulse_reg_3(unsigned n, uint8_t val) {
+    sync_for_reg_access();
+
     if (pulse[n].enabled)
         pulse[n].len_cnt = len_table[val >> 3];
     pulse[n].period = (pulse[n].period & ~0x700) | ((val & 7) << 8);
@@ -228,17 +281,23 @@ static bool     tri_lin_cnt_reload_flag;
 
 // $4008
 void write_triangle_reg_0(uint8_t val) {
+    sync_for_reg_access();
+
     tri_halt_flag    = val & 0x80;
     tri_lin_cnt_load = val & 0x7F;
 }
 
 // $400A
 void write_triangle_reg_1(uint8_t val) {
+    sync_for_reg_access();
+
     tri_period = (tri_period & ~0x0FF) | val;
 }
 
 // $400B
 void write_triangle_reg_2(uint8_t val) {
+    sync_for_reg_access();
+
     tri_lin_cnt_reload_flag = true;
     if (tri_enabled)
         tri_len_cnt = len_table[val >> 3];
@@ -305,6 +364,8 @@ static void update_noise_output_level() {
 
 // $400C
 void write_noise_reg_0(uint8_t val) {
+    sync_for_reg_access();
+
     noise_halt_len_loop_env = val & 0x20;
     noise_const_vol         = val & 0x10;
     noise_vol               = val & 0x0F;
@@ -320,12 +381,16 @@ static uint16_t const *noise_periods;
 
 // $400E
 void write_noise_reg_1(uint8_t val) {
+    sync_for_reg_access();
+
     noise_feedback_bit = (val & 0x80) ? 6 : 1;
     noise_period       = noise_periods[val & 0x0F];
 }
 
 // $400F
 void write_noise_reg_2(uint8_t val) {
+    sync_for_reg_access();
+
     if (noise_enabled) {
         noise_len_cnt = len_table[val >> 3];
         update_noise_output_level();
@@ -333,10 +398,14 @@ void write_noise_reg_2(uint8_t val) {
     noise_env_start_flag = true;
 }
 
-static void clock_noise_generator() {
+static unsigned next_noise_shift_reg(unsigned shift_reg) {
     // Only the lowest bit from 'feedback' is used
-    unsigned const feedback = (noise_shift_reg >> noise_feedback_bit) ^ noise_shift_reg;
-    noise_shift_reg = (feedback << 14) | (noise_shift_reg >> 1);
+    unsigned const feedback = (shift_reg >> noise_feedback_bit) ^ shift_reg;
+    return (feedback << 14) | (shift_reg >> 1);
+}
+
+static void clock_noise_generator() {
+    noise_shift_reg = next_noise_shift_reg(noise_shift_reg);
     update_noise_output_level();
 }
 
@@ -386,6 +455,8 @@ static uint16_t const *dmc_periods;
 
 // $4010
 void write_dmc_reg_0(uint8_t val) {
+    sync_for_reg_access();
+
     if (!(dmc_irq_enabled = val & 0x80))
         set_dmc_irq(false);
     dmc_loop_sample = val & 0x40;
@@ -394,6 +465,8 @@ void write_dmc_reg_0(uint8_t val) {
 
 // $4011
 void write_dmc_reg_1(uint8_t val) {
+    sync_for_reg_access();
+
     unsigned const old_dmc_counter = dmc_counter;
 
     dmc_counter = val & 0x7F;
@@ -404,14 +477,25 @@ void write_dmc_reg_1(uint8_t val) {
 
 // $4012
 void write_dmc_reg_2(uint8_t val) {
+    sync_for_reg_access();
+
     dmc_sample_start_addr = 0x4000 | (val << 6);
 }
 
 // $4013
 void write_dmc_reg_3(uint8_t val) {
+    sync_for_reg_access();
+
     dmc_sample_len = (val << 4) + 1;
 }
 
+// True if the DMC might load a sample byte soon. dmc_bytes_remaining can only
+// go from zero to non-zero through $4015 writes, so it not being up to date
+// (see sync_apu()) is fine here.
+static bool dmc_sample_load_possible() {
+    return dmc_bytes_remaining > 0;
+}
+
 static void load_dmc_sample_byte() {
     // Timing: http://forums.nesdev.com/viewtopic.php?p=62690#p62690
     static uint8_t const oam_dma_delay[] =
@@ -433,6 +517,10 @@ static void load_dmc_sample_byte() {
     // cpu_data_bus = dmc_sample_buffer;
 
     dmc_loading_sample_byte = true;
+    // The APU needs to keep up with the ticks below, as they happen in the
+    // middle of a DMC clock. sync_apu() keeps syncing on each tick while
+    // dmc_loading_sample_byte is set.
+    apu_event_lag = apu_lag + 1;
     unsigned const delay =
       (oam_dma_state != OAM_DMA_NOT_IN_PROGRESS) ?
         oam_dma_delay[oam_dma_state] :
@@ -598,6 +686,8 @@ static void clock_len_and_sweep() {
 
 // $4017
 void write_frame_counter(uint8_t val) {
+    sync_for_reg_access();
+
     frame_counter_mode = (Frame_counter_mode)(val >> 7);
     if ((inhibit_frame_irq = val & 0x40))
         set_frame_irq(false);
@@ -686,8 +776,28 @@ static void clock_frame_counter_generic() {
     }
 }
 
-// Points to the correct instantiated version for NTSC/PAL
+// Returns the number of ticks until the next tick on which
+// clock_frame_counter_generic() does something other than incrementing
+// frame_counter_clock
+template<unsigned T1, unsigned T2, unsigned T3, unsigned T4, unsigned T5>
+static unsigned ticks_till_frame_counter_step_generic() {
+    unsigned const c = frame_counter_clock;
+
+    if (delayed_frame_timer_reset > 0)
+        return 1;
+
+    if (c < T1 + 1) return T1 + 1 - c;
+    if (c < T2 + 1) return T2 + 1 - c;
+    if (c < T3 + 1) return T3 + 1 - c;
+
+    if (frame_counter_mode == FOUR_STEP)
+        return (c < T4) ? T4 - c : 1;
+    return (c < T5 + 1) ? T5 + 1 - c : 1;
+}
+
+// Point to the correct instantiated versions for NTSC/PAL
 static void (*clock_frame_counter)();
+static unsigned (*ticks_till_frame_counter_step)();
 
 //
 // Status
@@ -695,6 +805,8 @@ static void (*clock_frame_counter)();
 
 // $4015
 uint8_t read_apu_status() {
+    sync_apu();
+
     uint8_t const res =
       (dmc_irq                   << 7) |
       (frame_irq                 << 6) |
@@ -712,6 +824,8 @@ uint8_t read_apu_status() {
 
 // $4015
 void write_apu_status(uint8_t val) {
+    sync_for_reg_access();
+
     for (unsigned n = 0; n < 2; ++n) {
         if (!(pulse[n].enabled = val & (1 << n))) {
             pulse[n].len_cnt = 0;
@@ -750,21 +864,44 @@ void write_apu_status(uint8_t val) {
 // Mixer
 //
 
-// Use float instead of double to save some cache. Shouldn't make any
-// difference otherwise.
-static float pulse_mixer_table[31];
-static float tri_noi_dmc_mixer_table[203];
+// The tables hold signal levels scaled to the full int16_t range. They're
+// prebiased so that the sum of two entries is the final signal level, with
+// silence at INT16_MIN. Each table absorbs half of the bias to keep the
+// entries within int16_t.
+static int16_t pulse_mixer_table[31];
+static int16_t tri_noi_dmc_mixer_table[203];
+
+// Per-channel gain in units of 1/256, applied to the output levels before the
+// table lookups. 0 mutes the channel.
+static unsigned channel_gain[N_APU_CHANNELS];
+
+static int16_t mixer_table_entry(double level) {
+    return (int)(level*(INT16_MAX - INT16_MIN) + 0.5) + INT16_MIN/2;
+}
 
 void init_apu() {
     // http://wiki.nesdev.com/w/index.php/APU_Mixer
 
-    pulse_mixer_table[0] = 0;
+    pulse_mixer_table[0] = mixer_table_entry(0);
     for (unsigned n = 1; n < 31; ++n)
-        pulse_mixer_table[n] = 95.52/(8128.0/n + 100.0);
+        pulse_mixer_table[n] = mixer_table_entry(95.52/(8128.0/n + 100.0));
 
-    tri_noi_dmc_mixer_table[0] = 0;
+    tri_noi_dmc_mixer_table[0] = mixer_table_entry(0);
     for (unsigned n = 1; n < 203; ++n)
-        tri_noi_dmc_mixer_table[n] = 163.67/(24329.0/n + 100.0);
+        tri_noi_dmc_mixer_table[n] = mixer_table_entry(163.67/(24329.0/n + 100.0));
+
+    for (unsigned i = 0; i < N_APU_CHANNELS; ++i)
+        channel_gain[i] = 256;
+}
+
+void set_apu_channel_gain(APU_channel channel, unsigned gain) {
+    assert(channel < N_APU_CHANNELS);
+    assert(gain <= 256);
+
+    // Remix on the next tick
+    sync_for_reg_access();
+    channel_gain[channel] = gain;
+    channel_updated = true;
 }
 
 void init_apu_for_rom() {
@@ -779,6 +916,8 @@ void init_apu_for_rom() {
     if (is_pal) {
         clock_frame_counter =
           clock_frame_counter_generic<2*4156, 2*8313, 2*12469, 2*16626, 2*20782>;
+        ticks_till_frame_counter_step =
+          ticks_till_frame_counter_step_generic<2*4156, 2*8313, 2*12469, 2*16626, 2*20782>;
 
         dmc_periods         = pal_dmc_periods;
         noise_periods       = pal_noise_periods;
@@ -786,18 +925,20 @@ void init_apu_for_rom() {
     else {
         clock_frame_counter =
           clock_frame_counter_generic<2*3728, 2*7456, 2*11185, 2*14914, 2*18640>;
+        ticks_till_frame_counter_step =
+          ticks_till_frame_counter_step_generic<2*3728, 2*7456, 2*11185, 2*14914, 2*18640>;
 
         dmc_periods         = ntsc_dmc_periods;
         noise_periods       = ntsc_noise_periods;
     }
 }
 
-void tick_apu() {
-    apu_clk1_is_high = !apu_clk1_is_high;
-
+// Runs the APU for a single CPU tick. 'clk1_is_high' is the value of
+// apu_clk1_is_high during the tick.
+static void run_apu_tick(bool clk1_is_high) {
     clock_frame_counter();
 
-    if (!apu_clk1_is_high)
+    if (!clk1_is_high)
         //
         // Pulse
         //
@@ -839,18 +980,154 @@ void tick_apu() {
     //
 
     if (channel_updated) {
-        // Possible optimization: Could use integer math and prebias here
         int const signal_level =
-          INT16_MIN +
-            (pulse_mixer_table[pulse[0].output_level + pulse[1].output_level] +
-             tri_noi_dmc_mixer_table[tri_output_level + noise_output_level +
-                                     dmc_counter])*(INT16_MAX - INT16_MIN);
+          pulse_mixer_table[
+            (channel_gain[APU_PULSE_1]*pulse[0].output_level +
+             channel_gain[APU_PULSE_2]*pulse[1].output_level) >> 8] +
+          tri_noi_dmc_mixer_table[
+            (channel_gain[APU_TRIANGLE]*tri_output_level   +
+             channel_gain[APU_NOISE]   *noise_output_level +
+             channel_gain[APU_DMC]     *dmc_counter) >> 8];
         assert(signal_level <= INT16_MAX);
         set_audio_signal_level(signal_level);
 
         channel_updated = false;
     }
-    tick_audio();
+    tick_audio(1);
+}
+
+// Advances a timer that counts down from 'cnt' and is reloaded with 'period'
+// upon reaching zero by 'n' ticks. Returns the number of times it reached
+// zero.
+static unsigned advance_timer(unsigned &cnt, unsigned period, unsigned n) {
+    if (n < cnt) {
+        cnt -= n;
+        return 0;
+    }
+    unsigned const rem = n - cnt;
+    cnt = period - rem % period;
+    return 1 + rem/period;
+}
+
+static bool dmc_is_idle() {
+    return !dpcm_active && !dmc_sample_buffer_has_data && dmc_bytes_remaining == 0;
+}
+
+// Returns the number of upcoming ticks during which no channel output changes
+// and the frame counter and DMC do nothing that can't be skipped over by
+// skip_apu_ticks(). 'clk1_was_high' is the value of apu_clk1_is_high on the
+// most recently run tick.
+static unsigned quiet_apu_ticks(bool clk1_was_high) {
+    unsigned res = ticks_till_frame_counter_step() - 1;
+
+    // The pulse timers only count on every other tick
+    for (unsigned n = 0; n < 2; ++n) {
+        if (pulse_is_silent(n))
+            continue;
+
+        uint8_t const *const duty = pulse_duties[pulse[n].duty];
+        unsigned const pos = pulse[n].waveform_pos;
+        unsigned n_clocks = 1;
+        while (duty[(pos + n_clocks) % 8] == duty[pos])
+            ++n_clocks;
+        unsigned const n_low_ticks =
+          pulse[n].period_cnt + (n_clocks - 1)*(pulse[n].period + 1);
+        res = min(res, 2*n_low_ticks - clk1_was_high - 1);
+    }
+
+    if (tri_len_cnt > 0 && tri_lin_cnt > 0 && tri_period > 1 && tri_period <= 0x7FD)
+        res = min(res, tri_period_cnt - 1);
+
+    if (noise_len_cnt > 0 && (noise_const_vol ? noise_vol : noise_env_vol) > 0) {
+        // Find the first clock that changes the output. Give up after a while
+        // and just run the tick.
+        unsigned shift_reg = next_noise_shift_reg(noise_shift_reg);
+        unsigned n_clocks = 1;
+        while (n_clocks < 16 && !((shift_reg ^ noise_shift_reg) & 1)) {
+            shift_reg = next_noise_shift_reg(shift_reg);
+            ++n_clocks;
+        }
+        res = min(res, noise_period_cnt + (n_clocks - 1)*(noise_period + 1) - 1);
+    }
+
+    if (!dmc_is_idle())
+        res = min(res, dmc_period_cnt - 1);
+
+    return res;
+}
+
+// Skips over 'n' ticks, which must all be quiet as defined by
+// quiet_apu_ticks()
+static void skip_apu_ticks(unsigned n, bool clk1_was_high) {
+    frame_counter_clock += n;
+
+    unsigned const n_low_ticks = (n + clk1_was_high)/2;
+    for (unsigned i = 0; i < 2; ++i)
+        pulse[i].waveform_pos =
+          (pulse[i].waveform_pos +
+           advance_timer(pulse[i].period_cnt, pulse[i].period + 1, n_low_ticks)) % 8;
+
+    // Clocks are no-ops for an inactive triangle channel
+    advance_timer(tri_period_cnt, tri_period + 1, n);
+
+    for (unsigned n_clocks = advance_timer(noise_period_cnt, noise_period + 1, n);
+         n_clocks > 0; --n_clocks)
+        noise_shift_reg = next_noise_shift_reg(noise_shift_reg);
+
+    // An idle DMC only counts down the bits remaining of the output cycle
+    unsigned const n_dmc_clocks = advance_timer(dmc_period_cnt, dmc_period, n);
+    dmc_bits_remaining = 8 - (8 - dmc_bits_remaining + n_dmc_clocks) % 8;
+
+    tick_audio(n);
+}
+
+void sync_apu() {
+    while (apu_lag > 0) {
+        // apu_clk1_is_high is kept up to date by tick_apu(). Derive the value
+        // it had on the most recently run tick from it.
+        bool const clk1_was_high = apu_clk1_is_high ^ (apu_lag & 1);
+
+        if (!channel_updated) {
+            unsigned const n = min(apu_lag, quiet_apu_ticks(clk1_was_high));
+            if (n > 0) {
+                skip_apu_ticks(n, clk1_was_high);
+                apu_lag -= n;
+                continue;
+            }
+        }
+
+        // Decrement first, as run_apu_tick() might tick the CPU (and so the
+        // APU) recursively while loading a DMC sample byte
+        --apu_lag;
+        run_apu_tick(!clk1_was_high);
+    }
+
+    // Predict the next event
+
+    unsigned ticks_till_event = ticks_till_frame_counter_step();
+
+    if (dmc_loading_sample_byte)
+        ticks_till_event = 1;
+    else if (dmc_bytes_remaining > 0)
+        ticks_till_event =
+          min(ticks_till_event,
+              dmc_period_cnt + (dmc_bits_remaining - 1)*dmc_period);
+
+    apu_event_lag = ticks_till_event;
+}
+
+// Register accesses might change when the next event happens. Force a sync on
+// the next tick to recalculate it.
+static void sync_for_reg_access() {
+    sync_apu();
+    apu_event_lag = 1;
+}
+
+void tick_apu() {
+    apu_clk1_is_high = !apu_clk1_is_high;
+
+    if (++apu_lag >= apu_event_lag)
+        sync_apu();
 }
 
 //
@@ -858,6 +1135,8 @@ void tick_apu() {
 //
 
 void reset_apu() {
+    sync_apu();
+
     // Things explicitly initialized by the reset signal, derived from tracing
     // the _res node in Visual 2A03
 
@@ -931,6 +1210,9 @@ void reset_apu() {
     // Avoids a pop due to a sudden volume change when the triangle starts
     // playing
     tri_output_level = tri_waveform_steps[tri_waveform_pos];
+
+    // Recalculate the time of the next event on the next tick
+    apu_event_lag = 1;
 }
 
 void set_apu_cold_boot_state() {
@@ -997,6 +1279,9 @@ template<bool calculating_size, bool is_save>
 void transfer_apu_state(uint8_t *&buf) {
     #define T(x) transfer<calculating_size, is_save>(x, buf);
 
+    if (!calculating_size)
+        sync_apu();
+
     T(apu_clk1_is_high)
     T(oam_dma_state)
 
@@ -1086,6 +1371,9 @@ void transfer_apu_state(uint8_t *&buf) {
     T(frame_counter_clock)
     T(delayed_frame_timer_reset)
 
+    if (!is_save)
+        apu_event_lag = 1;
+
     #undef T
 }
 
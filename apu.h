@@ -7,6 +7,19 @@ void reset_apu();
 
 void begin_audio_frame();
 
+enum APU_channel {
+    APU_PULSE_1 = 0,
+    APU_PULSE_2,
+    APU_TRIANGLE,
+    APU_NOISE,
+    APU_DMC,
+    N_APU_CHANNELS
+};
+
+// Sets the mixer gain for a channel in units of 1/256, from 0 (muted) to 256
+// (full volume)
+void set_apu_channel_gain(APU_channel channel, unsigned gain);
+
 void write_pulse_reg_0(unsigned n, uint8_t value);
 void write_pulse_reg_1(unsigned n, uint8_t value);
 void write_pulse_reg_2(unsigned n, uint8_t value);
@@ -33,6 +46,8 @@ void write_frame_counter(uint8_t value);
 void do_oam_dma(uint8_t addr);
 
 void tick_apu();
+// Runs the APU up to the current CPU tick
+void sync_apu();
 
 extern bool dmc_irq;
 extern bool frame_irq;
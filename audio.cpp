@@ -1,18 +1,92 @@
 #include "common.h"
 
+#include "apu.h"
 #include "audio.h"
 #include "blip_buf.h"
 #include "save_states.h"
 #include "sdl_backend.h"
+#include "stats.h"
 #include "timing.h"
 
-// We try to keep the internal audio buffer 50% full for maximum protection
-// against under- and overflow. To maintain that level, we adjust the playback
-// rate slightly depending on the current buffer fill level. This sets the
-// maximum adjustment allowed (1.5%), though typical adjustments will be much
-// smaller.
+// We try to keep the internal audio buffer filled to a target level (see
+// below). To maintain that level, we adjust the playback rate slightly
+// depending on the current buffer fill level. This sets the maximum adjustment
+// allowed (1.5%), though typical adjustments will be much smaller.
 double const    max_adjust = 0.015;
 
+//
+// Latency control
+//
+// The target fill level determines the audio latency (together with SDL's
+// device buffer and the samples for the current frame). It starts out at
+// audio_latency_ms and is lowered gradually while no underflows occur, down to
+// what the device buffer needs. After an underflow it is raised, but at most
+// once per latency_increase_frames since the buffer needs time to fill up to
+// a new target. After an underflow, it takes longer before we start lowering
+// it again.
+//
+
+unsigned        audio_latency_ms = 90;
+
+double const    latency_decrease        = 0.9;
+unsigned const  latency_decrease_frames = 120;
+double const    latency_increase        = 1.5;
+unsigned const  latency_increase_frames = 60;
+// Number of frames without underflows before we try lowering the target
+unsigned const  quiet_frames_for_decrease = 600;
+
+// Target number of samples in the audio buffer
+static unsigned target_fill;
+static unsigned frames_since_target_change;
+static unsigned frames_since_underflow;
+static uint64_t prev_underflows;
+
+static unsigned min_target_fill() {
+    // The fill level is checked right before the samples for a frame are
+    // written, when it's at its lowest. At that point we need a device
+    // buffer's worth of samples for the next callback, plus 2 ms of slack for
+    // scheduling jitter.
+    return audio_device_buffer_samples + sample_rate/500;
+}
+
+static unsigned max_target_fill() {
+    // Leave room above the target for the rate adjustment to work with
+    return 3*audio_buf_capacity()/4;
+}
+
+static void set_target_fill(double samples) {
+    target_fill = (unsigned)min(max(samples, (double)min_target_fill()),
+                                (double)max_target_fill());
+    frames_since_target_change = 0;
+}
+
+static void update_target_fill() {
+    uint64_t const underflows = get_audio_underflows();
+    // Stats might have been reset
+    bool const underflowed = underflows > prev_underflows;
+    prev_underflows = underflows;
+
+    ++frames_since_target_change;
+
+    if (underflowed) {
+        frames_since_underflow = 0;
+        if (frames_since_target_change >= latency_increase_frames &&
+            target_fill < max_target_fill()) {
+            set_target_fill(latency_increase*target_fill);
+            printf("audio: underflow - raising latency target to %.1f ms\n",
+                   1000.0*target_fill/sample_rate);
+        }
+    }
+    else if (++frames_since_underflow >= quiet_frames_for_decrease &&
+             frames_since_target_change >= latency_decrease_frames &&
+             target_fill > min_target_fill())
+        set_target_fill(latency_decrease*target_fill);
+}
+
+double audio_latency_target_ms() {
+    return 1000.0*target_fill/sample_rate;
+}
+
 // To avoid an immediate underflow, we wait for the audio buffer to fill up
 // before we start playing. This is set true when we're happy with the fill
 // level.
@@ -70,6 +144,10 @@ void set_audio_signal_level(int16_t level) {
 }
 
 void end_audio_frame() {
+    // The APU runs lazily. Have it catch up so that all the deltas for the
+    // frame get added.
+    sync_apu();
+
     if (audio_frame_offset == 0)
         // No audio added; blip_end_frame() dislikes being called with an
         // offset of 0
@@ -88,15 +166,21 @@ void end_audio_frame() {
     audio_frame_offset = 0;
 
     if (playback_started) {
+        update_target_fill();
+
         // Fudge playback rate by an amount proportional to the difference
         // between the desired and current buffer fill levels to try to steer
-        // towards it
-
-        double const fudge_factor = 1.0 + 2*max_adjust*(0.5 - audio_buf_fill_level());
-        blip_set_rates(blip, cpu_clock_rate, sample_rate*fudge_factor);
+        // towards it. With vsync pacing, frames are also stretched to the
+        // display's frame length first, so that the fudging only needs to
+        // absorb drift.
+
+        double const error =
+          min(max(((double)target_fill - audio_buf_n_samples())/target_fill, -1.0), 1.0);
+        double const fudge_factor = 1.0 + max_adjust*error;
+        blip_set_rates(blip, cpu_clock_rate, sample_rate*frame_len_ratio*fudge_factor);
     }
     else {
-        if (audio_buf_fill_level() >= 0.5) {
+        if (audio_buf_n_samples() >= target_fill) {
             start_audio_playback();
             playback_started = true;
         }
@@ -112,16 +196,22 @@ void end_audio_frame() {
           avail);
         blip_clear(blip);
     }
-    add_audio_samples(blip_samples, n_samples);
+    // Frames re-run by seek() aren't heard
+    if (!seeking)
+        add_audio_samples(blip_samples, n_samples);
 }
 
-void tick_audio() { ++audio_frame_offset; }
+void tick_audio(unsigned n_ticks) { audio_frame_offset += n_ticks; }
 
 
 void init_audio_for_rom() {
     // Maximum number of unread samples the buffer can hold
     blip = blip_new(sample_rate/10);
     blip_set_rates(blip, cpu_clock_rate, sample_rate);
+
+    set_target_fill(audio_latency_ms*sample_rate/1000.0);
+    frames_since_underflow = quiet_frames_for_decrease;
+    prev_underflows = get_audio_underflows();
 }
 
 void deinit_audio_for_rom() {
@@ -3,6 +3,13 @@ void deinit_audio_for_rom();
 
 void end_audio_frame();
 void set_audio_signal_level(int16_t level);
-void tick_audio();
+void tick_audio(unsigned n_ticks);
 
 extern unsigned audio_frame_len;
+
+// Initial audio buffer latency target in milliseconds (excluding SDL's device
+// buffer). Set before loading a ROM. The target is adjusted automatically
+// based on underflows.
+extern unsigned audio_latency_ms;
+// Current latency target in milliseconds
+double audio_latency_target_ms();
@@ -20,6 +20,9 @@ public:
     // 0.0-1.0.
     double fill_level() const;
 
+    // Returns the number of samples in the ring buffer
+    size_t n_samples() const;
+
 private:
     int16_t buf[LENGTH];
     // Indices from start_index up to but not including end_index (modulo
@@ -137,7 +140,12 @@ bool Audio_ring_buffer<LENGTH>::read_samples(int16_t *out, size_t len) {
 
 template<size_t LENGTH>
 double Audio_ring_buffer<LENGTH>::fill_level() const {
-    double const data_len =
-      (end_index + LENGTH - start_index) % LENGTH;
-    return data_len/LENGTH;
+    return (double)n_samples()/LENGTH;
+}
+
+template<size_t LENGTH>
+size_t Audio_ring_buffer<LENGTH>::n_samples() const {
+    if (start_index == end_index)
+        return prev_op_was_read ? 0 : LENGTH;
+    return (end_index + LENGTH - start_index) % LENGTH;
 }
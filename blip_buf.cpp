@@ -7,6 +7,15 @@
 #include <string.h>
 #include <stdlib.h>
 
+/* SSE2 and AVX2 versions of the kernel addition in blip_add_delta(), picked
+at run time. Needs GCC or Clang for the target attribute and CPU detection. */
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+	#define BLIP_SIMD 1
+	#include <immintrin.h>
+#else
+	#define BLIP_SIMD 0
+#endif
+
 /* Library Copyright (C) 2003-2009 Shay Green. This library is free software;
 you can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -87,6 +96,8 @@ enum { min_sample = -32768 };
 			n = ARITH_SHIFT( n, 16 ) ^ max_sample;\
 	}
 
+static void init_add_kernel( void );
+
 static void check_assumptions( void )
 {
 	int n;
@@ -121,6 +132,7 @@ blip_t* blip_new( int size )
 		m->size   = size;
 		blip_clear( m );
 		check_assumptions();
+		init_add_kernel();
 	}
 	return m;
 }
@@ -291,23 +303,15 @@ possibly-wider fixed_t. On 32-bit platforms, this is likely more efficient.
 And by having pre_shift 32, a 32-bit platform can easily do the shift by
 simply ignoring the low half. */
 
-void blip_add_delta( blip_t* m, unsigned time, int delta )
-{
-	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
-	buf_t* out = SAMPLES( m ) + m->avail + (fixed >> frac_bits);
+/* Adds the kernel for 'phase', weighted by delta and delta2, to out [0] through
+out [half_width*2 - 1] */
+typedef void (*add_kernel_t)( buf_t* out, int phase, int delta, int delta2 );
 
-	int const phase_shift = frac_bits - phase_bits;
-	int phase = fixed >> phase_shift & (phase_count - 1);
+static void add_kernel_scalar( buf_t* out, int phase, int delta, int delta2 )
+{
 	short const* in  = bl_step [phase];
 	short const* rev = bl_step [phase_count - phase];
 
-	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
-	int delta2 = (delta * interp) >> delta_bits;
-	delta -= delta2;
-
-	/* Fails if buffer size was exceeded */
-	assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
-
 	out [0] += in[0]*delta + in[half_width+0]*delta2;
 	out [1] += in[1]*delta + in[half_width+1]*delta2;
 	out [2] += in[2]*delta + in[half_width+2]*delta2;
@@ -328,6 +332,111 @@ void blip_add_delta( blip_t* m, unsigned time, int delta )
 	out [15] += in[0]*delta + in[0-half_width]*delta2;
 }
 
+#if BLIP_SIMD
+
+/* The kernel with the coefficients for delta and delta2 interleaved and the
+reversed half unfolded, so that out [i] gets kernel_pairs [phase] [i] [0]*delta +
+kernel_pairs [phase] [i] [1]*delta2. That's what pmaddwd computes, given 16-bit
+factors. */
+static short kernel_pairs [phase_count] [half_width*2] [2];
+
+/* delta and delta2 don't fit in 16 bits, so they're split into low and high
+parts with delta = hi*delta_unit + lo and 0 <= lo < delta_unit, which gives
+products that agree with the scalar version modulo 2^32. Requires
+|delta| < 2^30. */
+static int low_factors( int delta, int delta2 )
+{
+	return (delta2 & (delta_unit - 1)) << 16 | (delta & (delta_unit - 1));
+}
+
+static int high_factors( int delta, int delta2 )
+{
+	return (int) ((unsigned) (ARITH_SHIFT( delta2, delta_bits ) & 0xFFFF) << 16 |
+	              (unsigned) (ARITH_SHIFT( delta , delta_bits ) & 0xFFFF));
+}
+
+__attribute__((target("sse2")))
+static void add_kernel_sse2( buf_t* out, int phase, int delta, int delta2 )
+{
+	__m128i const lo = _mm_set1_epi32( low_factors ( delta, delta2 ) );
+	__m128i const hi = _mm_set1_epi32( high_factors( delta, delta2 ) );
+	__m128i const* in = (__m128i const*) kernel_pairs [phase];
+	__m128i* io = (__m128i*) out;
+	int i;
+
+	for ( i = 0; i < half_width*2/4; ++i )
+	{
+		__m128i const k = _mm_loadu_si128( in + i );
+		__m128i const sum = _mm_add_epi32( _mm_madd_epi16( k, lo ),
+				_mm_slli_epi32( _mm_madd_epi16( k, hi ), delta_bits ) );
+		_mm_storeu_si128( io + i, _mm_add_epi32( _mm_loadu_si128( io + i ), sum ) );
+	}
+}
+
+__attribute__((target("avx2")))
+static void add_kernel_avx2( buf_t* out, int phase, int delta, int delta2 )
+{
+	__m256i const lo = _mm256_set1_epi32( low_factors ( delta, delta2 ) );
+	__m256i const hi = _mm256_set1_epi32( high_factors( delta, delta2 ) );
+	__m256i const* in = (__m256i const*) kernel_pairs [phase];
+	__m256i* io = (__m256i*) out;
+	int i;
+
+	for ( i = 0; i < half_width*2/8; ++i )
+	{
+		__m256i const k = _mm256_loadu_si256( in + i );
+		__m256i const sum = _mm256_add_epi32( _mm256_madd_epi16( k, lo ),
+				_mm256_slli_epi32( _mm256_madd_epi16( k, hi ), delta_bits ) );
+		_mm256_storeu_si256( io + i, _mm256_add_epi32( _mm256_loadu_si256( io + i ), sum ) );
+	}
+}
+
+#endif
+
+static add_kernel_t add_kernel = add_kernel_scalar;
+
+static void init_add_kernel( void )
+{
+#if BLIP_SIMD
+	int phase, i;
+
+	for ( phase = 0; phase < phase_count; ++phase )
+	{
+		for ( i = 0; i < half_width; ++i )
+		{
+			kernel_pairs [phase] [i] [0] = bl_step [phase    ] [i];
+			kernel_pairs [phase] [i] [1] = bl_step [phase + 1] [i];
+			kernel_pairs [phase] [half_width + i] [0] = bl_step [phase_count - phase    ] [half_width - 1 - i];
+			kernel_pairs [phase] [half_width + i] [1] = bl_step [phase_count - phase - 1] [half_width - 1 - i];
+		}
+	}
+
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		add_kernel = add_kernel_avx2;
+	else if ( __builtin_cpu_supports( "sse2" ) )
+		add_kernel = add_kernel_sse2;
+#endif
+}
+
+void blip_add_delta( blip_t* m, unsigned time, int delta )
+{
+	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
+	buf_t* out = SAMPLES( m ) + m->avail + (fixed >> frac_bits);
+
+	int const phase_shift = frac_bits - phase_bits;
+	int phase = fixed >> phase_shift & (phase_count - 1);
+
+	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+	int delta2 = (delta * interp) >> delta_bits;
+	delta -= delta2;
+
+	/* Fails if buffer size was exceeded */
+	assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
+
+	add_kernel( out, phase, delta, delta2 );
+}
+
 void blip_add_delta_fast( blip_t* m, unsigned time, int delta )
 {
 	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
@@ -8,6 +8,7 @@
 #include "mapper.h"
 #include "opcodes.h"
 #include "ppu.h"
+#include "profile.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
@@ -118,23 +119,31 @@ static unsigned pal_extra_tick;
 // PPU tick every fifth call. (This isn't perfect, but about as good as we can
 // do without getting into super-obscure hardware behavior, including PPU
 // half-ticks and analog effects.)
-void tick() {
-    if (is_pal) {
+//
+// Specialized for the TV system and the set of PPU events the mapper listens
+// for, so that neither needs to be checked per cycle or per dot.
+template<bool IS_PAL, unsigned PPU_EVENTS>
+static void tick_generic() {
+    PROF_BEGIN(PROF_PPU);
+    if (IS_PAL) {
         if (--pal_extra_tick == 0) {
             pal_extra_tick = 5;
-            tick_pal_ppu();
+            tick_ppu<true, PPU_EVENTS>();
         }
-        tick_pal_ppu();
-        tick_pal_ppu();
-        tick_pal_ppu();
+        tick_ppu<true, PPU_EVENTS>();
+        tick_ppu<true, PPU_EVENTS>();
+        tick_ppu<true, PPU_EVENTS>();
     }
     else {
-        tick_ntsc_ppu();
-        tick_ntsc_ppu();
-        tick_ntsc_ppu();
+        tick_ppu<false, PPU_EVENTS>();
+        tick_ppu<false, PPU_EVENTS>();
+        tick_ppu<false, PPU_EVENTS>();
     }
+    PROF_END(PROF_PPU);
 
+    PROF_BEGIN(PROF_APU);
     tick_apu();
+    PROF_END(PROF_APU);
 
 #ifdef RUN_TESTS
     if (ticks_till_reset > 0 && --ticks_till_reset == 0)
@@ -142,6 +151,32 @@ void tick() {
 #endif
 }
 
+// The tick_generic() instantiation for the current ROM. Set in
+// init_cpu_for_rom().
+static void (*tick_fn)();
+
+void tick() {
+    tick_fn();
+}
+
+void init_cpu_for_rom() {
+    // Helper for selecting the loop for a set of events. Needs to match the
+    // tick_ppu() instantiations in ppu.cpp.
+    #define SELECT_TICK(events) \
+      tick_fn = is_pal ? tick_generic<true, events> : tick_generic<false, events>
+
+    switch (mapper_ppu_events) {
+    case 0:                           SELECT_TICK(0);                           break;
+    case PPU_A12_RISE | PPU_A12_FALL: SELECT_TICK(PPU_A12_RISE | PPU_A12_FALL); break;
+    case PPU_LATCH_FETCH:             SELECT_TICK(PPU_LATCH_FETCH);             break;
+    case PPU_RENDER_DOT:              SELECT_TICK(PPU_RENDER_DOT);              break;
+    // Checks mapper_ppu_events at runtime
+    default:                          SELECT_TICK(PPU_ALL_EVENTS);              break;
+    }
+
+    #undef SELECT_TICK
+}
+
 //
 // CPU reading and writing
 //
@@ -187,6 +222,24 @@ uint8_t read(uint16_t addr) {
     return res;
 }
 
+uint8_t const *get_side_effect_free_page(uint8_t page) {
+    switch (page) {
+    case 0x00 ... 0x1F: return ram + 0x100*(page & 7);
+    case 0x60 ... 0x7F:
+        // Reads return open bus if there's no PRG RAM
+        return prg_ram_6000_page ? prg_ram_6000_page + 0x100*(page & 0x1F) : 0;
+    case 0x80 ... 0xFF: return prg_pages[(page >> 5) & 3] + 0x100*(page & 0x1F);
+    }
+
+    // Registers
+    return 0;
+}
+
+static void write_prg_ram(uint8_t *p, uint8_t val) {
+    *p = val;
+    mark_dirty(PRG_RAM_MEM, p - prg_ram_base);
+}
+
 static void write(uint8_t val, uint16_t addr) {
     // TODO: The write probably takes effect earlier within the CPU cycle than
     // after the three PPU ticks and the one APU tick
@@ -243,10 +296,14 @@ static void write(uint8_t val, uint16_t addr) {
         }
 #endif
 
-        if (prg_ram_6000_page) prg_ram_6000_page[addr & 0x1FFF] = val;
+        if (prg_ram_6000_page) write_prg_ram(prg_ram_6000_page + (addr & 0x1FFF), val);
         break;
 
-    case 0x8000 ... 0xFFFF: write_prg(addr, val); break;
+    case 0x8000 ... 0xFFFF:
+        // MMC5 can put PRG RAM into the $8000+ range
+        if (prg_page_is_ram[(addr >> 13) & 3])
+            write_prg_ram(prg_pages[(addr >> 13) & 3] + (addr & 0x1FFF), val);
+        break;
     }
 
     write_mapper(val, addr);
@@ -816,15 +873,32 @@ static void process_pending_events() {
     if (pending_frame_completion) {
         pending_frame_completion = false;
 
+        // Frames re-run by seek() aren't shown and run as fast as possible
+        if (!seeking) {
 // Run tests as fast as we can
 #ifndef RUN_TESTS
-        sleep_till_end_of_frame();
+            PROF_BEGIN(PROF_SLEEP);
+            sleep_till_end_of_frame();
+            PROF_END(PROF_SLEEP);
 #endif
-        draw_frame();
+            PROF_BEGIN(PROF_DRAW);
+            draw_frame();
+            PROF_END(PROF_DRAW);
+        }
+        PROF_BEGIN(PROF_AUDIO);
         end_audio_frame();
+        PROF_END(PROF_AUDIO);
         begin_audio_frame();
-        calc_controller_state();
-        handle_ui_keys();
+        if (seeking)
+            replay_frame();
+        else {
+            calc_controller_state();
+            record_frame();
+            handle_ui_keys();
+        }
+#ifdef PROFILE
+        prof_end_frame();
+#endif
     }
 
     if (pending_reset) {
@@ -1697,10 +1771,10 @@ static void reset_cpu() {
 template<bool calculating_size, bool is_save>
 void transfer_cpu_state(uint8_t *&buf) {
     #define T(x) transfer<calculating_size, is_save>(x, buf);
-    #define T_MEM(x, len) transfer_mem<calculating_size, is_save>(x, len, buf);
 
+    // PRG RAM is transferred by transfer_system_state(), as rewind saves it
+    // incrementally
     T(ram)
-    if (prg_ram_base) T_MEM(prg_ram_base, 0x2000*prg_ram_8k_banks)
     T(pc)
     T(a) T(s) T(x) T(y)
     T(zn) T(carry) T(irq_disable) T(decimal) T(overflow)
@@ -1714,7 +1788,6 @@ void transfer_cpu_state(uint8_t *&buf) {
         T(pal_extra_tick)
 
     #undef T
-    #undef T_MEM
 }
 
 // Explicit instantiations
@@ -1,7 +1,12 @@
+// Selects the emulation loop for the ROM's TV system and mapper
+void           init_cpu_for_rom();
 void           run();
 void           tick();
 
 uint8_t        read(uint16_t addr);
+// Returns the 256-byte page at $<page>00 if it can be read without side
+// effects, and null otherwise
+uint8_t const *get_side_effect_free_page(uint8_t page);
 
 void           set_nmi(bool s);
 
@@ -117,6 +117,18 @@ uint8_t get_button_states(unsigned n) {
            (c.b_pushed     << 1) |  c.a_pushed;
 }
 
+void set_button_states(unsigned n, uint8_t states) {
+    Controller_data &c = controller_data[n];
+    c.right_pushed  = NTH_BIT(states, 7);
+    c.left_pushed   = NTH_BIT(states, 6);
+    c.down_pushed   = NTH_BIT(states, 5);
+    c.up_pushed     = NTH_BIT(states, 4);
+    c.start_pushed  = NTH_BIT(states, 3);
+    c.select_pushed = NTH_BIT(states, 2);
+    c.b_pushed      = NTH_BIT(states, 1);
+    c.a_pushed      = NTH_BIT(states, 0);
+}
+
 template<bool calculating_size, bool is_save>
 void transfer_input_state(uint8_t *&buf) {
     #define T(x) transfer<calculating_size, is_save>(x, buf);
@@ -1,6 +1,8 @@
 void        init_input();
 void        calc_controller_state();
 uint8_t     get_button_states(unsigned n);
+// Inverse of get_button_states(). Used when replaying recorded input.
+void        set_button_states(unsigned n, uint8_t states);
 
 extern bool reset_pushed;
 
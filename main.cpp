@@ -5,14 +5,23 @@
 #include "cpu.h"
 #include "input.h"
 #include "mapper.h"
+#ifdef RECORD_MOVIE
+#  include "movie.h"
+#endif
 #include "ppu.h"
+#include "profile.h"
 #include "rom.h"
+#include "rom_db.h"
+#include "rom_index.h"
 #include "sdl_backend.h"
+#include "stats.h"
+#include "timing.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
 
 #include <SDL.h>
+#include <sched.h>
 
        char const *program_name;
 static char const *rom_filename;
@@ -23,26 +32,133 @@ static int emulation_thread(void*) {
     init_debug();
     init_input();
     init_mappers();
+    load_rom_db("rom_db.txt");
 
 #ifdef RUN_TESTS
     run_tests();
 #else
     load_rom(rom_filename, true);
     run();
+#ifdef PROFILE
+    print_prof_stats();
+#endif
+    print_pacing_stats();
+    printf("audio latency target at exit: %.1f ms\n", audio_latency_target_ms());
     unload_rom();
 #endif
 
+    unload_rom_db();
+
     return 0;
 }
 
+#ifndef RUN_TESTS
+static void usage() {
+    fprintf(stderr,
+      "usage: %s [options] <rom file>\n"
+      "       %s --index <directory>\n"
+      "\n"
+      "options:\n"
+      "  --spin-margin=US  spin instead of sleeping for the last US microseconds of\n"
+      "                    each frame (default: %u)\n"
+      "  --pin-cpu=N       pin the emulation thread to CPU N\n"
+      "  --realtime        run the emulation thread with SCHED_FIFO priority\n"
+      "  --vsync           pace frames by the display's refresh rate and adjust the\n"
+      "                    audio rate to match\n"
+      "  --audio-latency=MS\n"
+      "                    initial audio buffer latency (default: %u). Adjusted\n"
+      "                    automatically based on underflows.\n"
+      "  --audio-buffer=N  SDL audio device buffer size in samples, a power of two\n"
+      "                    (default: %u)\n"
+#ifdef RECORD_MOVIE
+      "  --movie-drop-frames\n"
+      "                    drop movie frames instead of waiting when the encoder\n"
+      "                    falls behind\n"
+#endif
+      ,
+      program_name, program_name, spin_margin_micros, audio_latency_ms,
+      audio_device_buffer_samples);
+    exit(EXIT_FAILURE);
+}
+
+// Returns false for unrecognized options and bad values
+static bool parse_option(char const *arg) {
+    char *end;
+
+    if (!strncmp(arg, "--spin-margin=", 14)) {
+        unsigned long const val = strtoul(arg + 14, &end, 10);
+        if (end == arg + 14 || *end != '\0' || val > 100000)
+            return false;
+        spin_margin_micros = val;
+        return true;
+    }
+
+    if (!strncmp(arg, "--pin-cpu=", 10)) {
+        long const val = strtol(arg + 10, &end, 10);
+        if (end == arg + 10 || *end != '\0' || val < 0 || val >= CPU_SETSIZE)
+            return false;
+        pin_to_cpu = val;
+        return true;
+    }
+
+    if (!strcmp(arg, "--realtime")) {
+        use_realtime_priority = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "--vsync")) {
+        vsync_pacing = true;
+        return true;
+    }
+
+    if (!strncmp(arg, "--audio-latency=", 16)) {
+        unsigned long const val = strtoul(arg + 16, &end, 10);
+        if (end == arg + 16 || *end != '\0' || val == 0 || val > 150)
+            return false;
+        audio_latency_ms = val;
+        return true;
+    }
+
+    if (!strncmp(arg, "--audio-buffer=", 15)) {
+        unsigned long const val = strtoul(arg + 15, &end, 10);
+        // SDL wants a power of two
+        if (end == arg + 15 || *end != '\0' || val < 64 || val > 8192 ||
+            (val & (val - 1)) != 0)
+            return false;
+        audio_device_buffer_samples = val;
+        return true;
+    }
+
+#ifdef RECORD_MOVIE
+    if (!strcmp(arg, "--movie-drop-frames")) {
+        movie_drop_frames = true;
+        return true;
+    }
+#endif
+
+    return false;
+}
+#endif
+
 int main(int argc, char *argv[]) {
     program_name = argv[0] ? argv[0] : "nesalizer";
 #ifndef RUN_TESTS
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <rom file>\n", program_name);
-        exit(EXIT_FAILURE);
+    if (argc == 3 && !strcmp(argv[1], "--index")) {
+        // Runs without the SDL subsystems (threads don't need them)
+        load_rom_db("rom_db.txt");
+        index_roms(argv[2]);
+        unload_rom_db();
+        return 0;
     }
-    rom_filename = argv[1];
+
+    int arg_i = 1;
+    for (; arg_i < argc && !strncmp(argv[arg_i], "--", 2); ++arg_i)
+        if (!parse_option(argv[arg_i]))
+            usage();
+
+    if (argc - arg_i != 1)
+        usage();
+    rom_filename = argv[arg_i];
 #endif
 
     init_sdl();
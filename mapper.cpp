@@ -2,11 +2,11 @@
 
 #include "cpu.h"
 #include "mapper.h"
+#include "ppu.h"
 #include "rom.h"
 
 static uint8_t nop_read(uint16_t) { return cpu_data_bus; } // Return open bus by default
 static void    nop_write(uint8_t, uint16_t) {}
-static void    nop_ppu_tick_callback() {}
 static uint8_t bad_nt_read(uint16_t addr) {
     fail("internal error: reading nametable address %04X with no read function defined",
          addr);
@@ -23,7 +23,8 @@ Mapper_fns mapper_functions[256];
 
 read_fn              *read_mapper;
 write_fn             *write_mapper;
-ppu_tick_callback_fn *ppu_tick_callback;
+unsigned              mapper_ppu_events;
+ppu_event_fn         *mapper_ppu_event;
 read_nt_fn           *mapper_read_nt;
 write_nt_fn          *mapper_write_nt;
 state_fn             *mapper_state_size;
@@ -46,58 +47,63 @@ void init_mappers() {
       mapper_functions[n].load_state = transfer_mapper_##n##_state<false, false>;
 
     // No mapper (hardwired/NROM)
-    #define MAPPER_NONE(n)                                           \
-      void mapper_##n##_init();                                      \
-      mapper_functions[n].init              = mapper_##n##_init;     \
-      mapper_functions[n].read              = nop_read;              \
-      mapper_functions[n].write             = nop_write;             \
-      mapper_functions[n].ppu_tick_callback = nop_ppu_tick_callback; \
-      mapper_functions[n].read_nt           = bad_nt_read;           \
-      mapper_functions[n].write_nt          = bad_nt_write;          \
-      mapper_functions[n].state_size        = nop_state_fn;          \
-      mapper_functions[n].save_state        = nop_state_fn;          \
+    #define MAPPER_NONE(n)                                       \
+      void mapper_##n##_init();                                  \
+      mapper_functions[n].init              = mapper_##n##_init; \
+      mapper_functions[n].read              = nop_read;          \
+      mapper_functions[n].write             = nop_write;         \
+      mapper_functions[n].ppu_events        = 0;                 \
+      mapper_functions[n].ppu_event         = 0;                 \
+      mapper_functions[n].read_nt           = bad_nt_read;       \
+      mapper_functions[n].write_nt          = bad_nt_write;      \
+      mapper_functions[n].state_size        = nop_state_fn;      \
+      mapper_functions[n].save_state        = nop_state_fn;      \
       mapper_functions[n].load_state        = nop_state_fn;
 
     // Mapper that only reacts to writes
-    #define MAPPER_W(n)                                              \
-      void mapper_##n##_init();                                      \
-      void mapper_##n##_write(uint8_t, uint16_t);                    \
-      mapper_functions[n].init              = mapper_##n##_init;     \
-      mapper_functions[n].read              = nop_read;              \
-      mapper_functions[n].write             = mapper_##n##_write;    \
-      mapper_functions[n].ppu_tick_callback = nop_ppu_tick_callback; \
-      mapper_functions[n].read_nt           = bad_nt_read;           \
-      mapper_functions[n].write_nt          = bad_nt_write;          \
+    #define MAPPER_W(n)                                           \
+      void mapper_##n##_init();                                   \
+      void mapper_##n##_write(uint8_t, uint16_t);                 \
+      mapper_functions[n].init              = mapper_##n##_init;  \
+      mapper_functions[n].read              = nop_read;           \
+      mapper_functions[n].write             = mapper_##n##_write; \
+      mapper_functions[n].ppu_events        = 0;                  \
+      mapper_functions[n].ppu_event         = 0;                  \
+      mapper_functions[n].read_nt           = bad_nt_read;        \
+      mapper_functions[n].write_nt          = bad_nt_write;       \
       MAPPER_STATE_FNS(n)
 
-    // Mapper that reacts to writes and (P)PU events
-    #define MAPPER_WP(n)                                                      \
-      void mapper_##n##_init();                                               \
-      void mapper_##n##_write(uint8_t, uint16_t);                             \
-      void mapper_##n##_ppu_tick_callback();                                  \
-      mapper_functions[n].init              = mapper_##n##_init;              \
-      mapper_functions[n].read              = nop_read;                       \
-      mapper_functions[n].write             = mapper_##n##_write;             \
-      mapper_functions[n].ppu_tick_callback = mapper_##n##_ppu_tick_callback; \
-      mapper_functions[n].read_nt           = bad_nt_read;                    \
-      mapper_functions[n].write_nt          = bad_nt_write;                   \
+    // Mapper that reacts to writes and (P)PU events. 'events' is the set of
+    // PPU_event values it listens for.
+    #define MAPPER_WP(n, events)                                      \
+      void mapper_##n##_init();                                       \
+      void mapper_##n##_write(uint8_t, uint16_t);                     \
+      void mapper_##n##_ppu_event(PPU_event);                         \
+      mapper_functions[n].init              = mapper_##n##_init;      \
+      mapper_functions[n].read              = nop_read;               \
+      mapper_functions[n].write             = mapper_##n##_write;     \
+      mapper_functions[n].ppu_events        = events;                 \
+      mapper_functions[n].ppu_event         = mapper_##n##_ppu_event; \
+      mapper_functions[n].read_nt           = bad_nt_read;            \
+      mapper_functions[n].write_nt          = bad_nt_write;           \
       MAPPER_STATE_FNS(n)
 
     // Mapper that reacts to reads, writes, PPU events, and has special
     // (n)ametable mirroring (e.g. MMC5)
-    #define MAPPER_RWPN(n)                                                    \
-      void mapper_##n##_init();                                               \
-      uint8_t mapper_##n##_read(uint16_t);                                    \
-      void mapper_##n##_write(uint8_t, uint16_t);                             \
-      void mapper_##n##_ppu_tick_callback();                                  \
-      uint8_t mapper_##n##_read_nt(uint16_t);                                 \
-      void mapper_##n##_write_nt(uint8_t, uint16_t);                          \
-      mapper_functions[n].init              = mapper_##n##_init;              \
-      mapper_functions[n].read              = mapper_##n##_read;              \
-      mapper_functions[n].write             = mapper_##n##_write;             \
-      mapper_functions[n].ppu_tick_callback = mapper_##n##_ppu_tick_callback; \
-      mapper_functions[n].read_nt           = mapper_##n##_read_nt;           \
-      mapper_functions[n].write_nt          = mapper_##n##_write_nt;          \
+    #define MAPPER_RWPN(n, events)                                    \
+      void mapper_##n##_init();                                       \
+      uint8_t mapper_##n##_read(uint16_t);                            \
+      void mapper_##n##_write(uint8_t, uint16_t);                     \
+      void mapper_##n##_ppu_event(PPU_event);                         \
+      uint8_t mapper_##n##_read_nt(uint16_t);                         \
+      void mapper_##n##_write_nt(uint8_t, uint16_t);                  \
+      mapper_functions[n].init              = mapper_##n##_init;      \
+      mapper_functions[n].read              = mapper_##n##_read;      \
+      mapper_functions[n].write             = mapper_##n##_write;     \
+      mapper_functions[n].ppu_events        = events;                 \
+      mapper_functions[n].ppu_event         = mapper_##n##_ppu_event; \
+      mapper_functions[n].read_nt           = mapper_##n##_read_nt;   \
+      mapper_functions[n].write_nt          = mapper_##n##_write_nt;  \
       MAPPER_STATE_FNS(n)
 
     // NROM
@@ -111,13 +117,13 @@ void init_mappers() {
     // "iNES Mapper 004 is a wide abstraction that can represent boards using the
     // Nintendo MMC3, Nintendo MMC6, or functional clones of any of the above. Most
     // games utilizing TxROM, DxROM, and HKROM boards use this designation."
-    MAPPER_WP(       4)
+    MAPPER_WP(       4, PPU_A12_RISE | PPU_A12_FALL)
     // MMC5/ExROM - Used by Castlevania III
-    MAPPER_RWPN(     5)
+    MAPPER_RWPN(     5, PPU_RENDER_DOT)
     // AxROM - Rare games often use this one
     MAPPER_W(        7)
     // MMC2 - only used by Punch-Out!!
-    MAPPER_WP(       9)
+    MAPPER_WP(       9, PPU_LATCH_FETCH)
     // Color Dreams
     MAPPER_W(       11)
     // Mapper-2-ish
@@ -145,6 +151,7 @@ uint8_t *prg_ram_6000_page;
 
 // Each 1 KB big
 uint8_t *chr_pages[8];
+uint8_t **sprite_chr_pages;
 
 // Memory remapping functions. 'n' specifies the slot, 'bank' the bank to map
 // there. Both are in units corresponding to the function.
@@ -218,29 +225,29 @@ void set_prg_6000_bank(unsigned bank) {
     prg_ram_6000_page = prg_ram_base + 0x2000*(bank & (prg_ram_8k_banks - 1));
 }
 
-void set_chr_8k_bank(unsigned bank) {
+void set_chr_8k_bank(unsigned bank, uint8_t **pages /* = chr_pages */) {
     uint8_t *const bank_ptr = chr_base + 0x2000*(bank & (chr_8k_banks - 1));
     for (unsigned i = 0; i < 8; ++i)
-        chr_pages[i] = bank_ptr + 0x400*i;
+        pages[i] = bank_ptr + 0x400*i;
 }
 
-void set_chr_4k_bank(unsigned n, unsigned bank) {
+void set_chr_4k_bank(unsigned n, unsigned bank, uint8_t **pages /* = chr_pages */) {
     assert(n < 2);
     uint8_t *const bank_ptr = chr_base + 0x1000*(bank & (2*chr_8k_banks - 1));
     for (unsigned i = 0; i < 4; ++i)
-        chr_pages[4*n + i] = bank_ptr + 0x400*i;
+        pages[4*n + i] = bank_ptr + 0x400*i;
 }
 
-void set_chr_2k_bank(unsigned n, unsigned bank) {
+void set_chr_2k_bank(unsigned n, unsigned bank, uint8_t **pages /* = chr_pages */) {
     assert(n < 4);
     uint8_t *const bank_ptr = chr_base + 0x800*(bank & (4*chr_8k_banks - 1));
     for (unsigned i = 0; i < 2; ++i)
-        chr_pages[2*n + i] = bank_ptr + 0x400*i;
+        pages[2*n + i] = bank_ptr + 0x400*i;
 }
 
-void set_chr_1k_bank(unsigned n, unsigned bank) {
+void set_chr_1k_bank(unsigned n, unsigned bank, uint8_t **pages /* = chr_pages */) {
     assert(n < 8);
-    chr_pages[n] = chr_base + 0x400*(bank & (8*chr_8k_banks - 1));
+    pages[n] = chr_base + 0x400*(bank & (8*chr_8k_banks - 1));
 }
 
 //
@@ -249,9 +256,22 @@ void set_chr_1k_bank(unsigned n, unsigned bank) {
 
 Mirroring mirroring;
 
+uint8_t *nt_pages[4];
+
 void set_mirroring(Mirroring m) {
+    // CIRAM page used for each nametable, in $2000, $2400, $2800, $2C00 order
+    static unsigned const nt_page_map[N_MIRRORING_MODES][4] = {
+      { 0, 0, 1, 1 },   // HORIZONTAL
+      { 0, 1, 0, 1 },   // VERTICAL
+      { 0, 0, 0, 0 },   // ONE_SCREEN_LOW
+      { 1, 1, 1, 1 },   // ONE_SCREEN_HIGH
+      { 0, 1, 2, 3 } }; // FOUR_SCREEN
+
     // In four-screen mode, the cart is assumed to be wired so that the mapper
     // can't influence mirroring
     if (mirroring != FOUR_SCREEN)
         mirroring = m;
+
+    for (unsigned i = 0; i < 4; ++i)
+        nt_pages[i] = (mirroring == SPECIAL) ? 0 : ciram + 0x400*nt_page_map[mirroring][i];
 }
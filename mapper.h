@@ -5,7 +5,25 @@ typedef uint8_t read_fn(uint16_t addr);
 typedef uint8_t read_nt_fn(uint16_t addr);
 typedef void    write_nt_fn(uint8_t value, uint16_t addr);
 typedef size_t  state_fn(uint8_t*&);
-typedef void    ppu_tick_callback_fn();
+
+// PPU events mappers can listen for. Each mapper declares the ones it needs in
+// Mapper_fns::ppu_events, and the PPU only looks for (and reports) those, so
+// mappers that don't listen for anything cost nothing per dot.
+enum PPU_event {
+    // A12 on the PPU address bus went high/low (MMC3 scanline counter)
+    PPU_A12_RISE    = 1 << 0,
+    PPU_A12_FALL    = 1 << 1,
+    // A dot where the PPU address bus is within one of the $0FDx, $0FEx,
+    // $1FDx, and $1FEx tile latch ranges, or just left one (MMC2)
+    PPU_LATCH_FETCH = 1 << 2,
+    // Dots 257, 321, and 337 on rendering lines while rendering, along with
+    // every dot while not rendering (MMC5)
+    PPU_RENDER_DOT  = 1 << 3,
+
+    PPU_ALL_EVENTS  = PPU_A12_RISE | PPU_A12_FALL | PPU_LATCH_FETCH | PPU_RENDER_DOT
+};
+
+typedef void    ppu_event_fn(PPU_event event);
 
 struct Mapper_fns {
     void                 (*init)();
@@ -13,7 +31,9 @@ struct Mapper_fns {
     write_fn              *write;
     read_nt_fn            *read_nt;
     write_nt_fn           *write_nt;
-    ppu_tick_callback_fn  *ppu_tick_callback;
+    // Bitmask of PPU_event values passed to ppu_event()
+    unsigned               ppu_events;
+    ppu_event_fn          *ppu_event;
     state_fn *state_size, *save_state, *load_state;
 };
 
@@ -25,12 +45,6 @@ inline uint8_t read_prg(uint16_t addr) {
     return prg_pages[(addr >> 13) & 3][addr & 0x1FFF];
 }
 
-// MMC5 can put PRG RAM into the $8000+ range
-inline void write_prg(uint16_t addr, uint8_t value) {
-    if (prg_page_is_ram[(addr >> 13) & 3])
-        prg_pages[(addr >> 13) & 3][addr & 0x1FFF] = value;
-}
-
 void set_prg_32k_bank(unsigned bank);
 // MMC5 can map writeable PRG RAM into the $8000+ range - hence the 'is_rom'
 // argument
@@ -40,11 +54,17 @@ void set_prg_8k_bank (unsigned n, int bank, bool is_rom = true);
 void set_prg_6000_bank(unsigned bank);
 
 extern uint8_t *chr_pages[8];
-
-void set_chr_8k_bank(unsigned bank);
-void set_chr_4k_bank(unsigned n, unsigned bank);
-void set_chr_2k_bank(unsigned n, unsigned bank);
-void set_chr_1k_bank(unsigned n, unsigned bank);
+// Pages used for sprite pattern fetches. Points to chr_pages except for MMC5,
+// which keeps separate pages for its sprite CHR banks so that it doesn't have
+// to remap chr_pages[] around the sprite fetches on each line.
+extern uint8_t **sprite_chr_pages;
+
+// 'pages' is the page table to modify. Only MMC5 uses another table than
+// chr_pages[].
+void set_chr_8k_bank(unsigned bank, uint8_t **pages = chr_pages);
+void set_chr_4k_bank(unsigned n, unsigned bank, uint8_t **pages = chr_pages);
+void set_chr_2k_bank(unsigned n, unsigned bank, uint8_t **pages = chr_pages);
+void set_chr_1k_bank(unsigned n, unsigned bank, uint8_t **pages = chr_pages);
 
 extern uint8_t *prg_ram;
 
@@ -61,13 +81,20 @@ enum Mirroring {
 };
 extern Mirroring mirroring;
 
+// Each 1 KB big. Null pages go through the mapper's read_nt/write_nt. All pages
+// are null for SPECIAL mirroring, though the mapper may fill in the ones it
+// doesn't need to see accesses to (MMC5 does).
+extern uint8_t *nt_pages[4];
+
+// Also updates nt_pages[]
 void set_mirroring(Mirroring m);
 
 extern Mapper_fns mapper_functions[256];
 
 extern read_fn              *read_mapper;
 extern write_fn             *write_mapper;
-extern ppu_tick_callback_fn *ppu_tick_callback;
+extern unsigned              mapper_ppu_events;
+extern ppu_event_fn         *mapper_ppu_event;
 extern read_nt_fn           *mapper_read_nt;
 extern write_nt_fn          *mapper_write_nt;
 extern state_fn             *mapper_state_size;
@@ -9,14 +9,19 @@ static unsigned temp_reg;
 static unsigned nth_write;
 static unsigned regs[4];
 
-static void apply_state() {
+// Writes to the CHR and PRG registers only remap CHR and PRG, respectively.
+// The control register affects everything.
+
+static void apply_mirroring() {
     switch (regs[0] & 3) {
     case 0: set_mirroring(ONE_SCREEN_LOW);  break;
     case 1: set_mirroring(ONE_SCREEN_HIGH); break;
     case 2: set_mirroring(VERTICAL);        break;
     case 3: set_mirroring(HORIZONTAL);      break;
     }
+}
 
+static void apply_prg_banks() {
     if (regs[0] & 8) {
         // 16K PRG mode
         if (regs[0] & 4) {
@@ -33,7 +38,9 @@ static void apply_state() {
     else
         // 32K PRG mode
         set_prg_32k_bank((regs[3] & 0x0F) >> 1);
+}
 
+static void apply_chr_banks() {
     if (regs[0] & 0x10) {
         // 4K CHR mode
         set_chr_4k_bank(0, regs[1]);
@@ -43,6 +50,12 @@ static void apply_state() {
         set_chr_8k_bank(regs[1] >> 1);
 }
 
+static void apply_state() {
+    apply_mirroring();
+    apply_prg_banks();
+    apply_chr_banks();
+}
+
 void mapper_1_init() {
     // Specified
     regs[0] = 0x0C; // 16K PRG swapping (0x08), swapping 8000-BFFF (0x04)
@@ -67,7 +80,7 @@ void mapper_1_write(uint8_t val, uint16_t addr) {
         nth_write = 0;
         temp_reg = 0;
         regs[0] |= 0x0C; // 16K PRG swapping (0x08), swapping 8000-BFFF (0x04)
-        apply_state();
+        apply_prg_banks();
     }
     else {
         temp_reg = ((val & 1) << 4) | (temp_reg >> 1);
@@ -83,7 +96,11 @@ void mapper_1_write(uint8_t val, uint16_t addr) {
             regs[(addr >> 13) & 3] = temp_reg;
             nth_write = 0;
             temp_reg = 0;
-            apply_state();
+            switch ((addr >> 13) & 3) {
+            case 0:         apply_state();     break;
+            case 1: case 2: apply_chr_banks(); break;
+            case 3:         apply_prg_banks(); break;
+            }
         }
     }
 }
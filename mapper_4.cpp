@@ -17,7 +17,10 @@ static uint8_t irq_period;
 static uint8_t irq_period_cnt;
 static bool    irq_enabled;
 
-static void apply_state() {
+// Register writes only remap the slots they affect. apply_state() remaps
+// everything and is used when initializing and loading state.
+
+static void apply_prg_banks() {
     // Second 8K PRG bank fixed to regs[7]
     set_prg_8k_bank(1, regs[7]);
     if (!(reg_8000 & 0x40)) {
@@ -30,25 +33,35 @@ static void apply_state() {
         set_prg_8k_bank(0, -2);
         set_prg_8k_bank(2, regs[6]);
     }
+}
 
-    if (!(reg_8000 & 0x80)) {
-        // [ <regs[0]> | <regs[1]> | regs[2..5] ]
-        set_chr_2k_bank(0, regs[0] >> 1);
-        set_chr_2k_bank(1, regs[1] >> 1);
-        for (unsigned i = 0; i < 4; ++i)
-            set_chr_1k_bank(4 + i, regs[2 + i]);
-    }
-    else {
-        // [ regs[2..5] | <regs[0]> | <regs[1]> ]
-        for (unsigned i = 0; i < 4; ++i)
-            set_chr_1k_bank(i, regs[2 + i]);
-        set_chr_2k_bank(2, regs[0] >> 1);
-        set_chr_2k_bank(3, regs[1] >> 1);
-    }
+// Maps the CHR bank in regs[n], for n = 0-5:
+//   reg_8000 bit 7 clear: [ <regs[0]> | <regs[1]> | regs[2..5] ]
+//   reg_8000 bit 7 set  : [ regs[2..5] | <regs[0]> | <regs[1]> ]
+static void apply_chr_bank(unsigned n) {
+    // Bit 7 swaps the 4 KB halves
+    unsigned const swap_1k_slots = (reg_8000 & 0x80) ? 4 : 0;
+    if (n < 2)
+        set_chr_2k_bank(n ^ (swap_1k_slots >> 1), regs[n] >> 1);
+    else
+        set_chr_1k_bank((n + 2) ^ swap_1k_slots, regs[n]);
+}
 
+static void apply_chr_banks() {
+    for (unsigned n = 0; n < 6; ++n)
+        apply_chr_bank(n);
+}
+
+static void apply_mirroring() {
     set_mirroring(horizontal_mirroring ? HORIZONTAL : VERTICAL);
 }
 
+static void apply_state() {
+    apply_prg_banks();
+    apply_chr_banks();
+    apply_mirroring();
+}
+
 void mapper_4_init() {
     init_array(regs, (unsigned)0);
     horizontal_mirroring = true; // Guess
@@ -65,18 +78,32 @@ void mapper_4_write(uint8_t val, uint16_t addr) {
     switch (((addr >> 12) & 6) | (addr & 1)) {
 
     case 0: // 0x8000
+        {
         LOG_MAPPER("8000\n");
+        // Only the PRG and CHR mode bits affect the mapping
+        unsigned const changed_bits = reg_8000 ^ val;
         reg_8000 = val;
+        if (changed_bits & 0x40) apply_prg_banks();
+        if (changed_bits & 0x80) apply_chr_banks();
         break;
+        }
 
     case 1: // 0x8001
+        {
         LOG_MAPPER("8001\n");
-        regs[reg_8000 & 7] = val;
+        unsigned const n = reg_8000 & 7;
+        regs[n] = val;
+        if (n < 6)
+            apply_chr_bank(n);
+        else
+            apply_prg_banks();
         break;
+        }
 
     case 2: // 0xA000
         LOG_MAPPER("A000\n");
         horizontal_mirroring = val & 1;
+        apply_mirroring();
         break;
 
     case 3: // 0xA001
@@ -108,8 +135,6 @@ void mapper_4_write(uint8_t val, uint16_t addr) {
 
     default: UNREACHABLE
     }
-
-    apply_state();
 }
 
 // There is a short delay after A12 rises till IRQ is asserted, but it probably
@@ -138,19 +163,18 @@ static void clock_scanline_counter() {
     }
 }
 
+// The last PPU cycle during which A12 was high. Updated on falling edges.
 static uint64_t last_a12_high_cycle;
 
 unsigned const min_a12_rise_diff = 16;
 
-void mapper_4_ppu_tick_callback() {
-    //if (delayed_irq > 0 && --delayed_irq == 0)
-        //set_cart_irq(true);
-
-    if (ppu_addr_bus & 0x1000) {
+void mapper_4_ppu_event(PPU_event event) {
+    if (event == PPU_A12_RISE) {
         if (ppu_cycle - last_a12_high_cycle >= min_a12_rise_diff)
             clock_scanline_counter();
-        last_a12_high_cycle = ppu_cycle;
     }
+    else // PPU_A12_FALL
+        last_a12_high_cycle = ppu_cycle - 1;
 }
 
 MAPPER_STATE_START(4)
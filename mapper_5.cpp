@@ -6,6 +6,7 @@
 #include "mapper.h"
 #include "ppu.h"
 #include "rom.h"
+#include "save_states.h"
 
 // 1 KB of extra on-chip memory
 static uint8_t exram[1024];
@@ -62,8 +63,14 @@ static uint8_t irq_scanline;
 static uint8_t scanline_cnt;
 static bool    in_frame;
 
-// 'true' if the background CHR mappings are currently active. Only an
-// optimization at the moment.
+// Sprite pattern fetches go through these pages (see sprite_chr_pages), so
+// chr_pages[] can keep the background mappings for the entire frame instead
+// of being remapped around the sprite fetches on each line
+static uint8_t *sprite_pages[8];
+
+// 'true' if chr_pages[] currently holds the background CHR mappings, which is
+// the case while rendering. Outside of rendering it holds the sprite
+// mappings.
 static bool using_bg_chr;
 
 // Fill mode
@@ -126,36 +133,70 @@ static void use_bg_chr() {
     }
 }
 
-static void use_sprite_chr() {
-    using_bg_chr = false;
-
+// Updates sprite_pages[] from the sprite CHR bank registers
+static void apply_sprite_chr_banks() {
     switch (chr_mode) {
     case 0:
-        set_chr_8k_bank(sprite_chr_banks[7]);
+        set_chr_8k_bank(sprite_chr_banks[7], sprite_pages);
         break;
 
     case 1:
-        set_chr_4k_bank(0, sprite_chr_banks[3]);
-        set_chr_4k_bank(1, sprite_chr_banks[7]);
+        set_chr_4k_bank(0, sprite_chr_banks[3], sprite_pages);
+        set_chr_4k_bank(1, sprite_chr_banks[7], sprite_pages);
         break;
 
     case 2:
-        set_chr_2k_bank(0, sprite_chr_banks[1]);
-        set_chr_2k_bank(1, sprite_chr_banks[3]);
-        set_chr_2k_bank(2, sprite_chr_banks[5]);
-        set_chr_2k_bank(3, sprite_chr_banks[7]);
+        set_chr_2k_bank(0, sprite_chr_banks[1], sprite_pages);
+        set_chr_2k_bank(1, sprite_chr_banks[3], sprite_pages);
+        set_chr_2k_bank(2, sprite_chr_banks[5], sprite_pages);
+        set_chr_2k_bank(3, sprite_chr_banks[7], sprite_pages);
         break;
 
     case 3:
         for (unsigned n = 0; n < 8; ++n)
-            set_chr_1k_bank(n, sprite_chr_banks[n]);
+            set_chr_1k_bank(n, sprite_chr_banks[n], sprite_pages);
         break;
 
     default: UNREACHABLE
     }
 }
 
-static void apply_state() {
+// Maps the sprite CHR banks into chr_pages[] as well
+static void use_sprite_chr() {
+    using_bg_chr = false;
+
+    for (unsigned n = 0; n < 8; ++n)
+        chr_pages[n] = sprite_pages[n];
+}
+
+// Points nt_pages[] directly at CIRAM and ExRAM for the nametables that don't
+// need any help from the mapper, so that fetches from them skip
+// mapper_5_read_nt(). Fill mode nametables, extended attribute mode, and
+// split mode still go through the mapper.
+static void apply_nt_pages() {
+    // Four-screen carts ignore the mapper's mirroring (see set_mirroring())
+    if (mirroring != SPECIAL) return;
+
+    bool const needs_mapper = exram_mode == 1 || (exram_mode == 0 && split_enabled);
+    for (unsigned i = 0; i < 4; ++i) {
+        uint8_t *page;
+        switch ((mmc5_mirroring >> 2*i) & 3) {
+        case 0: page = ciram;                         break;
+        case 1: page = ciram + 0x400;                 break;
+        // ExRAM reads as zero in modes 2 and 3
+        case 2: page = (exram_mode <= 1) ? exram : 0; break;
+        // Fill mode
+        case 3: page = 0;                             break;
+        default: UNREACHABLE
+        }
+        nt_pages[i] = needs_mapper ? 0 : page;
+    }
+}
+
+// Register writes only remap what they affect. apply_state() remaps everything
+// and is used when initializing and loading state.
+
+static void apply_prg_banks() {
     switch (prg_mode) {
     case 0:
         set_prg_32k_bank(prg_banks[3] >> 2);
@@ -181,10 +222,10 @@ static void apply_state() {
 
     default: UNREACHABLE
     }
+}
 
-    set_prg_6000_bank(prg_6000_bank);
-
-    // Update the currently active CHR mapping
+// Updates the currently active CHR mapping
+static void apply_chr_banks() {
     if (using_bg_chr) {
         // The BG CHR bank registers are not used in extended attribute mode
         if (exram_mode != 1)
@@ -194,6 +235,14 @@ static void apply_state() {
         use_sprite_chr();
 }
 
+static void apply_state() {
+    apply_prg_banks();
+    set_prg_6000_bank(prg_6000_bank);
+    apply_sprite_chr_banks();
+    apply_chr_banks();
+    apply_nt_pages();
+}
+
 void mapper_5_init() {
     init_array(exram, (uint8_t)0xFF);
     init_array(prg_banks, 0x7Fu);
@@ -211,6 +260,7 @@ void mapper_5_init() {
 
     fill_tile = fill_attrib = 0;
 
+    sprite_chr_pages = sprite_pages;
     // Assume the sprite CHR banks are used at startup
     using_bg_chr = false;
 
@@ -244,12 +294,26 @@ void mapper_5_write(uint8_t val, uint16_t addr) {
     if (addr < 0x5100) return;
 
     switch (addr) {
-    case 0x5100: prg_mode = val & 3;     break;
-    case 0x5101: chr_mode = val & 3;     break;
+    case 0x5100:
+        prg_mode = val & 3;
+        apply_prg_banks();
+        break;
+    case 0x5101:
+        chr_mode = val & 3;
+        apply_sprite_chr_banks();
+        apply_chr_banks();
+        break;
     case 0x5102: /* PRG RAM protect 1 */ break;
     case 0x5103: /* PRG RAM protect 2 */ break;
-    case 0x5104: exram_mode = val & 3;   break;
-    case 0x5105: mmc5_mirroring = val;   break;
+    case 0x5104:
+        exram_mode = val & 3;
+        apply_chr_banks();
+        apply_nt_pages();
+        break;
+    case 0x5105:
+        mmc5_mirroring = val;
+        apply_nt_pages();
+        break;
     case 0x5106: fill_tile = val;        break;
     case 0x5107:
     {
@@ -258,18 +322,30 @@ void mapper_5_write(uint8_t val, uint16_t addr) {
         break;
     }
 
-    case 0x5113: prg_6000_bank = val & 7; break;
+    case 0x5113:
+        prg_6000_bank = val & 7;
+        set_prg_6000_bank(prg_6000_bank);
+        break;
 
     case 0x5114 ... 0x5117:
         prg_banks[addr - 0x5114] = val;
+        apply_prg_banks();
         break;
 
+    // The CHR bank registers only need to be applied if their set is the
+    // active one
+
     case 0x5120 ... 0x5127:
         sprite_chr_banks[addr - 0x5120] = high_chr_bits | val;
+        apply_sprite_chr_banks();
+        if (!using_bg_chr)
+            use_sprite_chr();
         break;
 
     case 0x5128 ... 0x512B:
         bg_chr_banks[addr - 0x5128] = high_chr_bits | val;
+        if (using_bg_chr)
+            apply_chr_banks();
         break;
 
     case 0x5130: high_chr_bits = (val & 3) << 6; break;
@@ -278,6 +354,11 @@ void mapper_5_write(uint8_t val, uint16_t addr) {
         split_enabled  = val & 0x80;
         split_on_right = val & 0x40;
         split_tile_nr  = val & 0x1F;
+        apply_nt_pages();
+        // Restore the background mappings in case the split's CHR page was
+        // mapped
+        if (using_bg_chr)
+            apply_chr_banks();
         break;
     case 0x5201: split_y_scroll = val; break;
     case 0x5202: split_chr_page = val; break;
@@ -300,8 +381,6 @@ void mapper_5_write(uint8_t val, uint16_t addr) {
         }
         break;
     }
-
-    apply_state();
 }
 
 uint8_t mapper_5_read_nt(uint16_t addr) {
@@ -420,9 +499,15 @@ void mapper_5_write_nt(uint8_t val, uint16_t addr) {
     unsigned const bit_offset = (addr >> 9) & 6;
     switch ((mmc5_mirroring >> bit_offset) & 3) {
     // Internal nametable A
-    case 0: ciram[addr & 0x03FF] = val; break;
+    case 0:
+        ciram[addr & 0x03FF] = val;
+        mark_dirty(CIRAM_MEM, addr & 0x03FF);
+        break;
     // Internal nametable B
-    case 1: ciram[0x0400 | (addr & 0x03FF)] = val; break;
+    case 1:
+        ciram[0x0400 | (addr & 0x03FF)] = val;
+        mark_dirty(CIRAM_MEM, 0x0400 | (addr & 0x03FF));
+        break;
     // Use ExRAM as nametable
     case 2: if (exram_mode <= 1) exram[addr & 0x03FF] = val; break;
     // Assume the fill tile and attribute can't be written through the PPU in
@@ -430,7 +515,8 @@ void mapper_5_write_nt(uint8_t val, uint16_t addr) {
     }
 }
 
-void mapper_5_ppu_tick_callback() {
+// Called for PPU_RENDER_DOT events
+void mapper_5_ppu_event(PPU_event) {
     // It is not known exactly how the MMC5 detects scanlines. Cheat by looking
     // at the current rendering position and status.
 
@@ -443,10 +529,13 @@ void mapper_5_ppu_tick_callback() {
         return;
     }
 
-    if (dot == 257)
-        use_sprite_chr();
-    else if (dot == 321)
-        use_bg_chr();
+    // Sprite pattern fetches don't go through chr_pages[], so the background
+    // mappings only need to be restored on the first rendered line, or if
+    // extended attribute or split mode might have changed them
+    if (dot == 321) {
+        if (!using_bg_chr || exram_mode == 1 || split_enabled)
+            use_bg_chr();
+    }
     // 336 here shakes up Laser Invasion
     else if (dot == 337) {
         if (scanline < 240 || scanline == prerender_line) {
@@ -17,13 +17,26 @@ static unsigned previous_magic_bits;
 
 static bool horizontal_mirroring;
 
-static void apply_state() {
+// Writes and latch switches only remap the 4 KB half they affect
+
+static void apply_low_chr_bank() {
     set_chr_4k_bank(0, low_bank_uses_0FDx  ? chr_bank_0FDx : chr_bank_0FEx);
+}
+
+static void apply_high_chr_bank() {
     set_chr_4k_bank(1, high_bank_uses_1FDx ? chr_bank_1FDx : chr_bank_1FEx);
+}
 
+static void apply_mirroring() {
     set_mirroring(horizontal_mirroring ? HORIZONTAL : VERTICAL);
 }
 
+static void apply_state() {
+    apply_low_chr_bank();
+    apply_high_chr_bank();
+    apply_mirroring();
+}
+
 void mapper_9_init() {
     // Last three 8K PRG banks fixed
     set_prg_8k_bank(1, -3);
@@ -50,29 +63,34 @@ void mapper_9_write(uint8_t val, uint16_t addr) {
 
     case 3: // 0xB000
         chr_bank_0FDx = val & 0x1F;
+        apply_low_chr_bank();
         break;
 
     case 4: // 0xC000
         chr_bank_0FEx = val & 0x1F;
+        apply_low_chr_bank();
         break;
 
     case 5: // 0xD000
         chr_bank_1FDx = val & 0x1F;
+        apply_high_chr_bank();
         break;
 
     case 6: // 0xE000
         chr_bank_1FEx = val & 0x1F;
+        apply_high_chr_bank();
         break;
 
     case 7: // 0xF000
         horizontal_mirroring = val & 1;
+        apply_mirroring();
         break;
     }
-
-    apply_state();
 }
 
-void mapper_9_ppu_tick_callback() {
+// Only called for dots where ppu_addr_bus is or just was a magic value
+// (PPU_LATCH_FETCH)
+void mapper_9_ppu_event(PPU_event) {
     unsigned const magic_bits = ppu_addr_bus & 0xFFF0;
 
     if (magic_bits != 0x0FD0 && magic_bits != 0x0FE0 &&
@@ -80,10 +98,10 @@ void mapper_9_ppu_tick_callback() {
         // ppu_addr_bus is non-magic
 
         switch (previous_magic_bits) {
-        case 0x0FD0: low_bank_uses_0FDx  = true ; apply_state(); break;
-        case 0x0FE0: low_bank_uses_0FDx  = false; apply_state(); break;
-        case 0x1FD0: high_bank_uses_1FDx = true ; apply_state(); break;
-        case 0x1FE0: high_bank_uses_1FDx = false; apply_state(); break;
+        case 0x0FD0: low_bank_uses_0FDx  = true ; apply_low_chr_bank();  break;
+        case 0x0FE0: low_bank_uses_0FDx  = false; apply_low_chr_bank();  break;
+        case 0x1FD0: high_bank_uses_1FDx = true ; apply_high_chr_bank(); break;
+        case 0x1FE0: high_bank_uses_1FDx = false; apply_high_chr_bank(); break;
         }
     }
 
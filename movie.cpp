@@ -1,8 +1,15 @@
 // Movie recording using libav. Works out of the box on Ubuntu 13.10 with
 // libav 0.8, which meant using some now deprecated APIs.
+//
+// Encoding happens in a separate thread so that it doesn't slow down
+// emulation. Video frames and audio blocks are copied into a bounded queue
+// that the encoder thread works through in order. If the queue fills up, the
+// emulation thread either waits or drops video frames, depending on
+// movie_drop_frames.
 
 #include "common.h"
 
+#include "movie.h"
 #include "rom.h"
 #include "sdl_backend.h"
 
@@ -16,6 +23,7 @@ extern "C" {
 #include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 }
+#include <SDL.h>
 #include <SDL_endian.h>
 
 unsigned const                 vid_scale_factor = 3;
@@ -70,9 +78,53 @@ static SwsContext             *video_conv_ctx;
 // Holds x264 options
 static AVDictionary           *video_opts;
 
-// The index of the next video frame to be encoded
+// The index of the next video frame to be encoded. Dropped frames are
+// counted too, so that audio stays in sync.
 static int64_t                 frame_n;
 
+// Encoder queue
+
+bool                           movie_drop_frames;
+
+// Largest audio block in a job. Longer blocks are split.
+size_t const                   max_job_samples = sample_rate/25;
+
+struct Movie_job {
+    bool     is_video;
+    // For video jobs, the index of the frame. For audio jobs, the number of
+    // video frames that preceded the block (for A/V synchronization).
+    int64_t  frame_n;
+    size_t   n_samples;
+    union {
+        uint32_t frame[240*256];
+        int16_t  samples[max_job_samples];
+    };
+};
+
+unsigned const                 job_queue_len = 16;
+// With movie_drop_frames, video frames are dropped when at least this many
+// jobs are queued. Leaves room for audio, which is never dropped.
+unsigned const                 video_drop_threshold = 3*job_queue_len/4;
+
+static Movie_job              *jobs;
+// Jobs from job_start up to (but not including) job_start + n_jobs (modulo
+// wrapping) are queued. The emulation thread adds jobs at the end and the
+// encoder thread removes them from the start.
+static unsigned                job_start;
+static unsigned                n_jobs;
+static bool                    stop_encoder;
+
+static SDL_mutex              *job_lock;
+static SDL_cond               *job_added_cond;
+static SDL_cond               *job_done_cond;
+static SDL_Thread             *encoder_thread;
+
+// Used only by the emulation thread
+static int64_t                 next_frame_n;
+static unsigned long           n_dropped_frames;
+
+static void init_encoder_thread();
+
 
 static void check_av_error(int err, char const *msg) {
     if (err < 0) {
@@ -193,6 +245,9 @@ static void init_video() {
     av_dict_set(&video_opts, "preset", "slow"     , 0);
     av_dict_set(&video_opts, "tune"  , "animation", 0);
     av_dict_set(&video_opts, "crf"   , "18"       , 0);
+    // Let x264 use all cores. Frames are encoded in order in the encoder
+    // thread, and x264 spreads the work across its own threads.
+    av_dict_set(&video_opts, "threads", "auto"    , 0);
 
     // Open the video encoder
     check_av_error(avcodec_open2(video_encoder_ctx, 0, &video_opts), "failed to open video encoder");
@@ -267,6 +322,8 @@ void init_movie() {
 
     // Write stream header, if any
     check_av_error(avformat_write_header(output_ctx, 0), "failed to write movie header");
+
+    init_encoder_thread();
 }
 
 static void write_audio_frame(int frame_size) {
@@ -331,7 +388,7 @@ static void write_audio_frames() {
     */
 }
 
-void add_movie_audio_frame(int16_t *samples, size_t len) {
+static void encode_audio(int16_t *samples, size_t len) {
     int const n_samples = audio_resample(resample_ctx, (short*)audio_tmp_buf, (short*)samples, len);
     int const n_written = av_fifo_generic_write(audio_fifo, audio_tmp_buf, sample_bsize*n_samples, 0);
     if (n_written != sample_bsize*n_samples)
@@ -392,7 +449,7 @@ static void write_video_frame(int frame_size) {
     }
 }
 
-void add_movie_video_frame(uint32_t *frame_data) {
+static void encode_video_frame(uint32_t *frame_data, int64_t n) {
     // Scale and convert to the video's pixel format
     AVPicture frame_pic;
     avpicture_fill(&frame_pic,
@@ -422,7 +479,7 @@ void add_movie_video_frame(uint32_t *frame_data) {
           "failed to write video frame (raw frame case)");
     }
     else {
-        video_frame->pts = frame_n++;
+        video_frame->pts = n;
 
         // Encode frame
         int const frame_size = avcodec_encode_video(video_encoder_ctx,
@@ -431,6 +488,7 @@ void add_movie_video_frame(uint32_t *frame_data) {
 
         write_video_frame(frame_size);
     }
+    frame_n = n + 1;
 }
 
 // Flushes any remaining frames (e.g. due to B frames) from the encoder at the
@@ -453,7 +511,132 @@ static void flush_video() {
 }
 
 
+//
+// Encoder thread and job queue
+//
+
+static int encode_jobs(void*) {
+    for (;;) {
+        SDL_LockMutex(job_lock);
+        while (n_jobs == 0 && !stop_encoder)
+            SDL_CondWait(job_added_cond, job_lock);
+        if (n_jobs == 0) {
+            // Stopped and all jobs done
+            SDL_UnlockMutex(job_lock);
+            return 0;
+        }
+        Movie_job &job = jobs[job_start];
+        SDL_UnlockMutex(job_lock);
+
+        if (job.is_video)
+            encode_video_frame(job.frame, job.frame_n);
+        else {
+            frame_n = job.frame_n;
+            encode_audio(job.samples, job.n_samples);
+        }
+
+        SDL_LockMutex(job_lock);
+        job_start = (job_start + 1) % job_queue_len;
+        --n_jobs;
+        SDL_CondSignal(job_done_cond);
+        SDL_UnlockMutex(job_lock);
+    }
+}
+
+// Returns a free slot at the end of the queue, waiting for one if needed. If
+// 'may_drop' is true and the queue is getting full, returns null instead. The
+// slot becomes visible to the encoder thread after submit_job().
+static Movie_job *get_free_job(bool may_drop) {
+    SDL_LockMutex(job_lock);
+    if (may_drop && n_jobs >= video_drop_threshold) {
+        SDL_UnlockMutex(job_lock);
+        return 0;
+    }
+    while (n_jobs == job_queue_len)
+        SDL_CondWait(job_done_cond, job_lock);
+    Movie_job *const job = &jobs[(job_start + n_jobs) % job_queue_len];
+    SDL_UnlockMutex(job_lock);
+
+    return job;
+}
+
+static void submit_job() {
+    SDL_LockMutex(job_lock);
+    ++n_jobs;
+    SDL_CondSignal(job_added_cond);
+    SDL_UnlockMutex(job_lock);
+}
+
+void add_movie_video_frame(uint32_t *frame_argb) {
+    Movie_job *const job = get_free_job(movie_drop_frames);
+    if (!job) {
+        ++n_dropped_frames;
+        ++next_frame_n;
+        return;
+    }
+
+    job->is_video = true;
+    job->frame_n  = next_frame_n++;
+    memcpy(job->frame, frame_argb, sizeof job->frame);
+    submit_job();
+}
+
+void add_movie_audio_frame(int16_t *samples, size_t len) {
+    while (len > 0) {
+        size_t const n = min(len, max_job_samples);
+
+        Movie_job *const job = get_free_job(false);
+        job->is_video  = false;
+        job->frame_n   = next_frame_n;
+        job->n_samples = n;
+        memcpy(job->samples, samples, sizeof(int16_t)*n);
+        submit_job();
+
+        samples += n;
+        len     -= n;
+    }
+}
+
+static void init_encoder_thread() {
+    fail_if(!(jobs = new (std::nothrow) Movie_job[job_queue_len]),
+      "failed to allocate movie encoder queue");
+    job_start = n_jobs = 0;
+    stop_encoder = false;
+    next_frame_n = 0;
+    n_dropped_frames = 0;
+
+    fail_if(!(job_lock = SDL_CreateMutex()),
+      "failed to create movie encoder mutex: %s", SDL_GetError());
+    fail_if(!(job_added_cond = SDL_CreateCond()),
+      "failed to create movie encoder condition variable: %s", SDL_GetError());
+    fail_if(!(job_done_cond = SDL_CreateCond()),
+      "failed to create movie encoder condition variable: %s", SDL_GetError());
+    fail_if(!(encoder_thread = SDL_CreateThread(encode_jobs, "movie encoder", 0)),
+      "failed to create movie encoder thread: %s", SDL_GetError());
+}
+
+// Waits for the encoder thread to finish the queued jobs and exit
+static void deinit_encoder_thread() {
+    SDL_LockMutex(job_lock);
+    stop_encoder = true;
+    SDL_CondSignal(job_added_cond);
+    SDL_UnlockMutex(job_lock);
+    SDL_WaitThread(encoder_thread, 0);
+
+    SDL_DestroyMutex(job_lock);
+    SDL_DestroyCond(job_added_cond);
+    SDL_DestroyCond(job_done_cond);
+    free_array_set_null(jobs);
+
+    if (n_dropped_frames > 0)
+        printf("Dropped %lu movie frames because the encoder couldn't keep up\n",
+               n_dropped_frames);
+}
+
+
 void end_movie() {
+    deinit_encoder_thread();
+
     flush_audio();
     flush_video();
 
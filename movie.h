@@ -1,5 +1,12 @@
 void init_movie();
+// Waits for queued frames to be encoded and finishes the movie
 void end_movie();
 
+// Queue audio and video for encoding in the encoder thread. The data is
+// copied.
 void add_movie_audio_frame(int16_t *samples, size_t len);
 void add_movie_video_frame(uint32_t *frame_argb);
+
+// If true, video frames are dropped when the encoder falls behind instead of
+// making the emulation wait for it. Audio is never dropped.
+extern bool movie_drop_frames;
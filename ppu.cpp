@@ -11,7 +11,9 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "mapper.h"
+#include "profile.h"
 #include "rom.h"
+#include "save_states.h"
 #include "sdl_backend.h"
 #include "timing.h"
 
@@ -28,148 +30,220 @@ bool const             starts_on_initial_frame = false;
 // Nametable memory of variable size, initialized when loading the ROM
 uint8_t               *ciram;
 
+// Pre-decoded CHR, allocated when loading the ROM. There is one entry per CHR
+// byte. For a tile row whose low plane byte is at offset i, entry i holds the
+// eight 2-bit pixels of the row (leftmost pixel in the low byte), and entry
+// i + 8 (the high plane byte's slot) holds the same row flipped horizontally.
+// CHR ROM is decoded once. CHR RAM rows are re-decoded as they are written.
+uint64_t              *decoded_chr;
+
 // The number of the last line in the frame, at the end of the VBlank interval.
 // Differs between PAL and NTSC.
 unsigned               prerender_line;
 
-static uint8_t         palettes[0x20];
-static uint8_t         oam     [0x100];
-static uint8_t         sec_oam [0x20];
-
-// VRAM address/scroll regs. 15 bits long. Use 'unsigned' rather than
-// 'uint16_t' as it gives neater code and these are quite hot.
-static unsigned        t, v;
-static uint8_t         fine_x;
-// v is not immediately updated from t on the second write to $2006. This
-// variable implements the delay.
-static unsigned        pending_v_update;
-
-static unsigned        v_inc;           // $2000:2
-static uint16_t        sprite_pat_addr; // $2000:3
-static uint16_t        bg_pat_addr;     // $2000:4
-static Sprite_size     sprite_size;     // $2000:5
-static bool            nmi_on_vblank;   // $2000:7
-
-static uint8_t         grayscale_color_mask; // $2001:0 - 0x30 if grayscale mode enabled, otherwise 0x3F
-static bool            show_bg_left_8;       // $2001:1
-static bool            show_sprites_left_8;  // $2001:2
-static bool            show_bg;              // $2001:3
-static bool            show_sprites;         // $2001:4
-static uint8_t         tint_bits;            // $2001:7-5
-
-// Optimization - always equals show_bg || show_sprites
-bool                   rendering_enabled;
-// Optimizations - if bg/sprites are disabled, a value is set that causes
-// comparisons to always fail. If the leftmost 8 pixels are clipped, the
-// comparison will fail for those pixels. Otherwise, the comparison will never
-// fail.
-static unsigned        bg_clip_comp;
-static unsigned        sprite_clip_comp;
-
-static bool            sprite_overflow; // $2002:5
-static bool            sprite_zero_hit; // $2002:6
-static bool            in_vblank;       // $2002:7
-
-static uint8_t         oam_addr;        // $2003
-// Pointer into the secondary OAM, 5 bits wide
-//  - Updated during sprite evaluation and loading
-//  - Cleared at dots 64.5, 256.5 and 340.5, if rendering
-static unsigned        sec_oam_addr;
-static uint8_t         oam_data;        // $2004 (seen when reading from $2004)
-
-// Sprite evaluation state
-
-// Goes high for three ticks when an in-range sprite is found during sprite
-// evaluation
-static unsigned        copy_sprite_signal;
-static bool            oam_addr_overflow, sec_oam_addr_overflow;
-static bool            overflow_detection;
-
-// PPUSCROLL/PPUADDR write flip-flop. First write when false, second write when
-// true.
-static bool            write_flip_flop;
-
-// $2007 read buffer
-static uint8_t         ppu_data_reg;
-
-static bool            odd_frame;
-
 // Used as a general-purpose timestamp throughout the emulator. Good for
 // 109 000 years.
 uint64_t               ppu_cycle;
 
-// Internal PPU counters and registers
-
+// Internal PPU counters. Also used by mappers.
 unsigned               dot, scanline;
 
-static uint8_t         nt_byte, at_byte;
-static uint8_t         bg_byte_l, bg_byte_h;
-static uint16_t        bg_shift_l, bg_shift_h;
-static unsigned        at_shift_l, at_shift_h;
-static unsigned        at_latch_l, at_latch_h;
+// Optimization - always equals show_bg || show_sprites
+bool                   rendering_enabled;
+
+// VRAM address currently being output (MMC3 looks at this). Set via
+// set_ppu_addr_bus() from within tick_ppu().
+unsigned               ppu_addr_bus;
 
-static uint8_t         sprite_attribs[8];
-static uint8_t         sprite_x[8];
-static uint8_t         sprite_pat_l[8];
-static uint8_t         sprite_pat_h[8];
+// PPU state is split into hot state, touched on most dots while rendering, and
+// cold state, mostly touched on register accesses. Keeping the hot state
+// together in an aligned struct (ordered roughly by when things are accessed
+// during a line) keeps the per-dot working set to a few cache lines. It also
+// lets transfer_ppu_state() save and load each struct with a single memcpy().
+//
+// Everything in here gets saved in states.
+
+static struct PPU_hot_state {
+    // VRAM address/scroll regs. 15 bits long. Use 'unsigned' rather than
+    // 'uint16_t' as it gives neater code and these are quite hot.
+    unsigned    v;
+    uint8_t     fine_x;
+
+    // Background fetching and the background pixel pipeline
+
+    uint16_t    bg_pat_addr;     // $2000:4
+    uint8_t     nt_byte, at_byte;
+    // Decoded pixels of the tile being fetched. The low and high bit of each
+    // pixel come from the low and high tile byte fetches, respectively.
+    uint64_t    bg_row;
+    // Background pixel shift register, 16 pixels wide. bg_pixels holds the
+    // pixels being output (the current one in the low byte) and
+    // bg_pixels_next the following eight.
+    uint64_t    bg_pixels, bg_pixels_next;
+    unsigned    at_shift_l, at_shift_h;
+    unsigned    at_latch_l, at_latch_h;
+
+    // Pixel output
+
+    // Optimizations - if bg/sprites are disabled, a value is set that causes
+    // comparisons to always fail. If the leftmost 8 pixels are clipped, the
+    // comparison will fail for those pixels. Otherwise, the comparison will
+    // never fail.
+    unsigned    bg_clip_comp;
+    unsigned    sprite_clip_comp;
+
+    uint8_t     sprite_attribs[8];
+    uint8_t     sprite_x[8];
+    // Decoded sprite pixels, with horizontal flipping already applied
+    uint64_t    sprite_pixels[8];
+    bool        s0_on_cur_scanline;
+
+    uint8_t     palettes[0x20];
+
+    // Sprite evaluation and loading
+
+    uint16_t    sprite_pat_addr; // $2000:3
+    Sprite_size sprite_size;     // $2000:5
+
+    uint8_t     oam_addr;        // $2003
+    // Pointer into the secondary OAM, 5 bits wide
+    //  - Updated during sprite evaluation and loading
+    //  - Cleared at dots 64.5, 256.5 and 340.5, if rendering
+    unsigned    sec_oam_addr;
+    uint8_t     oam_data;        // $2004 (seen when reading from $2004)
+
+    // Goes high for three ticks when an in-range sprite is found during
+    // sprite evaluation
+    unsigned    copy_sprite_signal;
+    bool        oam_addr_overflow, sec_oam_addr_overflow;
+    bool        overflow_detection;
+
+    bool        s0_on_next_scanline;
+
+    // Temporary storage (also exists in PPU) for data during sprite loading
+    uint8_t     sprite_y, sprite_index;
+    bool        sprite_in_range;
+
+    uint8_t     sec_oam[0x20];
+
+    // Scrolling and mapper event detection
+
+    unsigned    t;
+    // v is not immediately updated from t on the second write to $2006. This
+    // variable implements the delay.
+    unsigned    pending_v_update;
+
+    // A12 level last reported to the mapper
+    bool        prev_a12_high;
+    // Set when a $2007 access changes ppu_addr_bus from outside tick_ppu().
+    // A12 transitions from it are reported at the end of the next dot.
+    bool        a12_check_pending;
+    // State as of the previous dot, used to detect PPU_LATCH_FETCH events
+    bool        prev_on_latch_addr;
+} hot __attribute__((aligned(64)));
+
+static struct PPU_cold_state {
+    uint8_t     oam[0x100];
+
+    unsigned    v_inc;                // $2000:2
+    bool        nmi_on_vblank;        // $2000:7
+
+    uint8_t     grayscale_color_mask; // $2001:0 - 0x30 if grayscale mode enabled, otherwise 0x3F
+    bool        show_bg_left_8;       // $2001:1
+    bool        show_sprites_left_8;  // $2001:2
+    bool        show_bg;              // $2001:3
+    bool        show_sprites;         // $2001:4
+    uint8_t     tint_bits;            // $2001:7-5
+
+    bool        sprite_overflow;      // $2002:5
+    bool        sprite_zero_hit;      // $2002:6
+    bool        in_vblank;            // $2002:7
+
+    // PPUSCROLL/PPUADDR write flip-flop. First write when false, second write
+    // when true.
+    bool        write_flip_flop;
+
+    // $2007 read buffer
+    uint8_t     ppu_data_reg;
+
+    bool        odd_frame;
+
+    // Writes to certain registers are suppressed during the initial frame:
+    // http://wiki.nesdev.com/w/index.php/PPU_power_up_state
+    //
+    // Emulating this makes NY2011 and possibly other demos hang. They probably
+    // don't run on the real thing either.
+    bool        initial_frame;
 
-static bool            s0_on_next_scanline;
-static bool            s0_on_cur_scanline;
+    // Open bus for reads from PPU $2000-$2007 (tested by ppu_open_bus.nes)
+    uint8_t     ppu_open_bus;
+    uint64_t    ppu_bit_7_to_6_write_cycle, ppu_bit_5_write_cycle, ppu_bit_4_to_0_write_cycle;
+} cold;
 
-// Temporary storage (also exists in PPU) for data during sprite loading
-static uint8_t         sprite_y, sprite_index;
-static bool            sprite_in_range;
+static unsigned        open_bus_decay_cycles;
 
-// Writes to certain registers are suppressed during the initial frame:
-// http://wiki.nesdev.com/w/index.php/PPU_power_up_state
-//
-// Emulating this makes NY2011 and possibly other demos hang. They probably
-// don't run on the real thing either.
-static bool            initial_frame;
+// CHR decoding
 
-// VRAM address currently being output (MMC3 looks at this)
-unsigned               ppu_addr_bus;
+// Selects the low and high bits of the pixels in a decoded row
+static uint64_t const  pixel_low_bits  = 0x0101010101010101ULL;
+static uint64_t const  pixel_high_bits = 0x0202020202020202ULL;
 
-// Open bus for reads from PPU $2000-$2007 (tested by ppu_open_bus.nes)
+// Decodes the tile row whose low plane byte is at CHR offset 'offset'
+static void decode_chr_row(unsigned offset) {
+    assert(!(offset & 8));
 
-static uint8_t         ppu_open_bus;
-static uint64_t        ppu_bit_7_to_6_write_cycle, ppu_bit_5_write_cycle, ppu_bit_4_to_0_write_cycle;
+    uint8_t const low  = chr_base[offset];
+    uint8_t const high = chr_base[offset + 8];
+    uint64_t row = 0, flipped_row = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        uint64_t const pixel = (NTH_BIT(high, 7 - i) << 1) | NTH_BIT(low, 7 - i);
+        row         |= pixel << 8*i;
+        flipped_row |= pixel << 8*(7 - i);
+    }
+    decoded_chr[offset]     = row;
+    decoded_chr[offset + 8] = flipped_row;
+}
 
-static unsigned        open_bus_decay_cycles;
+void decode_chr(unsigned offset, unsigned len) {
+    for (unsigned tile = offset; tile < offset + len; tile += 16)
+        for (unsigned row = 0; row < 8; ++row)
+            decode_chr_row(tile + row);
+}
 
 void init_ppu_for_rom() {
     prerender_line = is_pal ? 311 : 261;
     // PPU open bus values fade after about 600 ms
     open_bus_decay_cycles = 0.6*ppu_clock_rate;
+    decode_chr(0, 0x2000*chr_8k_banks);
 }
 
 static void open_bus_refreshed() {
-    ppu_bit_7_to_6_write_cycle = ppu_bit_5_write_cycle = ppu_bit_4_to_0_write_cycle = ppu_cycle;
+    cold.ppu_bit_7_to_6_write_cycle = cold.ppu_bit_5_write_cycle = cold.ppu_bit_4_to_0_write_cycle = ppu_cycle;
 }
 
 static void open_bus_bits_7_to_5_refreshed() {
-    ppu_bit_7_to_6_write_cycle = ppu_bit_5_write_cycle = ppu_cycle;
+    cold.ppu_bit_7_to_6_write_cycle = cold.ppu_bit_5_write_cycle = ppu_cycle;
 }
 
 static void open_bus_bits_5_to_0_refreshed() {
-    ppu_bit_5_write_cycle = ppu_bit_4_to_0_write_cycle = ppu_cycle;
+    cold.ppu_bit_5_write_cycle = cold.ppu_bit_4_to_0_write_cycle = ppu_cycle;
 }
 
 static uint8_t get_open_bus_bits_7_to_6() {
-    return (ppu_cycle - ppu_bit_7_to_6_write_cycle > open_bus_decay_cycles) ?
-      0 : ppu_open_bus & 0xC0;
+    return (ppu_cycle - cold.ppu_bit_7_to_6_write_cycle > open_bus_decay_cycles) ?
+      0 : cold.ppu_open_bus & 0xC0;
 }
 
 static uint8_t get_open_bus_bits_4_to_0() {
-    return (ppu_cycle - ppu_bit_4_to_0_write_cycle > open_bus_decay_cycles) ?
-      0 : ppu_open_bus & 0x1F;
+    return (ppu_cycle - cold.ppu_bit_4_to_0_write_cycle > open_bus_decay_cycles) ?
+      0 : cold.ppu_open_bus & 0x1F;
 }
 
 static uint8_t get_all_open_bus_bits() {
     return
       get_open_bus_bits_7_to_6() |
-      ((ppu_cycle - ppu_bit_5_write_cycle > open_bus_decay_cycles) ?
-         0 : ppu_open_bus & 0x20) |
+      ((ppu_cycle - cold.ppu_bit_5_write_cycle > open_bus_decay_cycles) ?
+         0 : cold.ppu_open_bus & 0x20) |
       get_open_bus_bits_4_to_0();
 }
 
@@ -178,78 +252,111 @@ static uint8_t &chr_ref(unsigned chr_addr) {
     return chr_pages[(chr_addr >> 10) & 7][chr_addr & 0x03FF];
 }
 
-// Nametable reading and writing
-
-// Returns the physical CIRAM address after mirroring
-static uint16_t get_mirrored_address(uint16_t addr) {
-    switch (mirroring) {
-    case VERTICAL:        return addr & 0x07FF;
-    case HORIZONTAL:      return ((addr >> 1) & 0x0400) + (addr & 0x03FF);
-    case ONE_SCREEN_LOW:  return addr & 0x03FF;
-    case ONE_SCREEN_HIGH: return 0x0400 + (addr & 0x03FF);
-    case FOUR_SCREEN:     return addr & 0x0FFF;
-    default: UNREACHABLE;
+// Returns the pattern byte at 'chr_addr' spread out over eight pixels, with
+// one bit in the low bit of each pixel byte. Uses the decoded row containing
+// the byte, flipped horizontally if 'flip' is true. Going by the address
+// rather than by which fetch is being done keeps things right in odd cases
+// where the address bus doesn't hold the expected plane (which happens with
+// some mid-frame register fiddling). 'pages' is chr_pages or
+// sprite_chr_pages.
+static uint64_t chr_pixels(uint8_t *const *pages, unsigned chr_addr, bool flip) {
+    uint64_t const row =
+      decoded_chr[(pages[(chr_addr >> 10) & 7] - chr_base) +
+                  (chr_addr & 0x03F7) + 8*flip];
+    return (row >> NTH_BIT(chr_addr, 3)) & pixel_low_bits;
+}
+
+static void report_ppu_event(PPU_event event) {
+    PROF_BEGIN(PROF_MAPPER_EVENT);
+    mapper_ppu_event(event);
+    PROF_END(PROF_MAPPER_EVENT);
+}
+
+// Reports A12 transitions on ppu_addr_bus to the mapper
+static void raise_a12_events() {
+    bool const a12_high = ppu_addr_bus & 0x1000;
+    if (a12_high != hot.prev_a12_high) {
+        hot.prev_a12_high = a12_high;
+        PPU_event const event = a12_high ? PPU_A12_RISE : PPU_A12_FALL;
+        if (mapper_ppu_events & event)
+            report_ppu_event(event);
     }
 }
 
+// A12 edges can only happen when the PPU puts a new address on the bus, so
+// report them from here instead of checking A12 on every dot
+static void set_ppu_addr_bus(unsigned addr) {
+    ppu_addr_bus = addr;
+    if (mapper_ppu_events & (PPU_A12_RISE | PPU_A12_FALL))
+        raise_a12_events();
+}
+
+// Nametable reading and writing. Mirroring is handled by nt_pages[], which has
+// null pages for mapper-specific mirroring.
+
 static uint8_t read_nt(uint16_t addr) {
-    return (mirroring == SPECIAL) ?
-      mapper_read_nt(addr) :
-      ciram[get_mirrored_address(addr)];
+    uint8_t *const page = nt_pages[(addr >> 10) & 3];
+    return page ? page[addr & 0x03FF] : mapper_read_nt(addr);
 }
 
 static void write_nt(uint16_t addr, uint8_t val) {
-    if (mirroring == SPECIAL)
-        mapper_write_nt(val, addr);
+    uint8_t *const page = nt_pages[(addr >> 10) & 3];
+    if (page) {
+        page[addr & 0x03FF] = val;
+        // MMC5 can map ExRAM here too, which is saved with the mapper state
+        size_t const offset = page + (addr & 0x03FF) - ciram;
+        if (offset < tracked_mem_len[CIRAM_MEM])
+            mark_dirty(CIRAM_MEM, offset);
+    }
     else
-        ciram[get_mirrored_address(addr)] = val;
+        mapper_write_nt(val, addr);
 }
 
 // Bumps the horizontal bits in v every eight pixels during rendering
 static void bump_horiz() {
     // Coarse x equal to 31?
-    if ((v & 0x1F) == 0x1F)
+    if ((hot.v & 0x1F) == 0x1F)
         // Set coarse x to 0 and switch horizontal nametable. The bit twiddling
         // to clear the lower five bits relies on them being 1.
-        v ^= 0x041F;
-    else ++v;
+        hot.v ^= 0x041F;
+    else ++hot.v;
 }
 
 // Bumps the vertical bits in v at the end of each scanline during rendering
 static void bump_vert() {
     // Fine y equal to 7?
-    if ((v & 0x7000) == 0x7000)
+    if ((hot.v & 0x7000) == 0x7000)
         // Check coarse y
-        switch (v & 0x03E0) {
+        switch (hot.v & 0x03E0) {
 
         // Coarse y equal to 29. Switch vertical nametable (XOR by 0x0800) and
         // clear fine y and coarse y in the same operation (possible since we
         // know their value).
-        case 29 << 5: v ^= 0x7800 | (29 << 5); break;
+        case 29 << 5: hot.v ^= 0x7800 | (29 << 5); break;
 
         // Coarse y equal to 31. Clear fine y and coarse y without switching
         // vertical nametable (this occurs for vertical scroll values > 240).
-        case 31 << 5: v &= ~0x73E0; break;
+        case 31 << 5: hot.v &= ~0x73E0; break;
 
         // Clear fine y and increment coarse y
-        default: v = (v & ~0x7000) + 0x0020;
+        default: hot.v = (hot.v & ~0x7000) + 0x0020;
         }
     else
         // Bump fine y
-        v += 0x1000;
+        hot.v += 0x1000;
 }
 
 // Restores the horizontal bits in v from t at the end of each scanline during
 // rendering
 static void copy_horiz() {
     // v: ... .H.. ...E DCBA = t: ... .H.. ...E DCBA
-    v = (v & ~0x041F) | (t & 0x041F);
+    hot.v = (hot.v & ~0x041F) | (hot.t & 0x041F);
 }
 
 // Initializes the vertical bits in v from t on the pre-render line
 static void copy_vert() {
     // v: IHG F.ED CBA. .... = t: IHG F.ED CBA. ....
-    v = (v & ~0x7BE0) | (t & 0x7BE0);
+    hot.v = (hot.v & ~0x7BE0) | (hot.t & 0x7BE0);
 }
 
 // Fetches nametable and tile bytes for the background
@@ -257,36 +364,36 @@ static void do_bg_fetches() {
     switch ((dot - 1) % 8) {
 
     // NT byte
-    case 0: ppu_addr_bus = 0x2000 | (v & 0x0FFF); break;
-    case 1: nt_byte = read_nt(ppu_addr_bus);      break;
+    case 0: set_ppu_addr_bus(0x2000 | (hot.v & 0x0FFF)); break;
+    case 1: hot.nt_byte = read_nt(ppu_addr_bus);         break;
 
     // AT byte
     case 2:
         //    yyy NNAB CDEG HIJK
         // =>  10 NN11 11AB CGHI
         // 1162 is the Visual 2C02 signal that sets up this address
-        ppu_addr_bus = 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 7);
+        set_ppu_addr_bus(0x23C0 | (hot.v & 0x0C00) | ((hot.v >> 4) & 0x38) | ((hot.v >> 2) & 7));
         break;
     case 3:
-        at_byte = read_nt(ppu_addr_bus);
+        hot.at_byte = read_nt(ppu_addr_bus);
         break;
 
     // Low BG tile byte
     case 4:
-        assert(v <= 0x7FFF);
-        ppu_addr_bus = bg_pat_addr + 16*nt_byte + (v >> 12);
+        assert(hot.v <= 0x7FFF);
+        set_ppu_addr_bus(hot.bg_pat_addr + 16*hot.nt_byte + (hot.v >> 12));
         break;
     case 5:
-        bg_byte_l = chr_ref(ppu_addr_bus);
+        hot.bg_row = (hot.bg_row & pixel_high_bits) | chr_pixels(chr_pages, ppu_addr_bus, false);
         break;
 
     // High BG tile byte and horizontal bump
     case 6:
-        assert(v <= 0x7FFF);
-        ppu_addr_bus = bg_pat_addr + 16*nt_byte + (v >> 12) + 8;
+        assert(hot.v <= 0x7FFF);
+        set_ppu_addr_bus(hot.bg_pat_addr + 16*hot.nt_byte + (hot.v >> 12) + 8);
         break;
     case 7:
-        bg_byte_h = chr_ref(ppu_addr_bus);
+        hot.bg_row = (hot.bg_row & pixel_low_bits) | (chr_pixels(chr_pages, ppu_addr_bus, false) << 1);
         bump_horiz();
         break;
     }
@@ -298,18 +405,17 @@ static void do_bg_fetches() {
 static unsigned get_sprite_pixel(unsigned &spr_pal, bool &spr_behind_bg, bool &spr_is_s0) {
     unsigned const pixel = dot - 2;
     // Equivalent to 'if (!show_sprites || (!show_sprites_left_8 && pixel < 8))'
-    if (pixel < sprite_clip_comp)
+    if (pixel < hot.sprite_clip_comp)
         return 0;
 
     for (unsigned i = 0; i < 8; ++i) {
-        unsigned const offset = pixel - sprite_x[i];
+        unsigned const offset = pixel - hot.sprite_x[i];
         if (offset < 8) { // offset >= 0 && offset < 8
-            unsigned const pat_res = (NTH_BIT(sprite_pat_h[i], 7 - offset) << 1) |
-                                      NTH_BIT(sprite_pat_l[i], 7 - offset);
+            unsigned const pat_res = (hot.sprite_pixels[i] >> 8*offset) & 3;
             if (pat_res) {
-                spr_pal       = sprite_attribs[i] & 3;
-                spr_behind_bg = sprite_attribs[i] & 0x20;
-                spr_is_s0     = s0_on_cur_scanline && (i == 0);
+                spr_pal       = hot.sprite_attribs[i] & 3;
+                spr_behind_bg = hot.sprite_attribs[i] & 0x20;
+                spr_is_s0     = hot.s0_on_cur_scanline && (i == 0);
                 return pat_res;
             }
         }
@@ -330,7 +436,7 @@ static void do_pixel_output_and_sprite_0() {
         // If v points in the $3Fxx range while rendering is disabled, the
         // color from that palette index is displayed instead of the background
         // color
-        pal_index = (~v & 0x3F00) ? 0 : v & 0x1F;
+        pal_index = (~hot.v & 0x3F00) ? 0 : hot.v & 0x1F;
     else {
         unsigned       bg_pixel_pat;
 
@@ -339,14 +445,13 @@ static void do_pixel_output_and_sprite_0() {
         unsigned const spr_pat = get_sprite_pixel(spr_pal, spr_behind_bg, spr_is_s0);
 
         // Equivalent to 'if (!show_bg || (!show_bg_left_8 && pixel < 8))'
-        if (pixel < bg_clip_comp)
+        if (pixel < hot.bg_clip_comp)
             bg_pixel_pat = 0;
         else {
-            bg_pixel_pat = (NTH_BIT(bg_shift_h, 15 - fine_x) << 1) |
-                            NTH_BIT(bg_shift_l, 15 - fine_x);
+            bg_pixel_pat = (hot.bg_pixels >> 8*hot.fine_x) & 3;
 
             if (spr_pat && spr_is_s0 && bg_pixel_pat && pixel != 255)
-                sprite_zero_hit = true;
+                cold.sprite_zero_hit = true;
         }
 
         if (spr_pat && !(spr_behind_bg && bg_pixel_pat))
@@ -355,31 +460,30 @@ static void do_pixel_output_and_sprite_0() {
             if (!bg_pixel_pat)
                 pal_index = 0;
             else {
-                unsigned const attr_bits = (NTH_BIT(at_shift_h, 7 - fine_x) << 1) |
-                                            NTH_BIT(at_shift_l, 7 - fine_x);
+                unsigned const attr_bits = (NTH_BIT(hot.at_shift_h, 7 - hot.fine_x) << 1) |
+                                            NTH_BIT(hot.at_shift_l, 7 - hot.fine_x);
                 pal_index = (attr_bits << 2) | bg_pixel_pat;
             }
         }
     }
 
-    put_pixel(pixel, scanline, pal_to_rgb[palettes[pal_index] & grayscale_color_mask]);
+    put_pixel(pixel, scanline, pal_to_rgb[hot.palettes[pal_index] & cold.grayscale_color_mask]);
 }
 
 // Shifts the background shift registers, reloading the upper eight bits and
 // the attribute bits every eight pixels
 static void do_shifts_and_reloads() {
-    assert(at_latch_l <= 1);
-    assert(at_latch_h <= 1);
+    assert(hot.at_latch_l <= 1);
+    assert(hot.at_latch_h <= 1);
 
-    bg_shift_l <<= 1;
-    bg_shift_h <<= 1;
-    at_shift_l = (at_shift_l << 1) | at_latch_l;
-    at_shift_h = (at_shift_h << 1) | at_latch_h;
+    hot.bg_pixels        = (hot.bg_pixels >> 8) | (hot.bg_pixels_next << 56);
+    hot.bg_pixels_next >>= 8;
+    hot.at_shift_l = (hot.at_shift_l << 1) | hot.at_latch_l;
+    hot.at_shift_h = (hot.at_shift_h << 1) | hot.at_latch_h;
 
     if (dot % 8 == 1) {
         // Reload regs
-        bg_shift_l = (bg_shift_l & 0xFF00) | bg_byte_l;
-        bg_shift_h = (bg_shift_h & 0xFF00) | bg_byte_h;
+        hot.bg_pixels_next = hot.bg_row;
 
         // v:
         //
@@ -410,26 +514,26 @@ static void do_shifts_and_reloads() {
         // unsigned const coarse_y = (v >> 5) & 0x1F;
         // unsigned const at_bits =
         //   at_byte >> 2*((coarse_y & 0x02) | (((coarse_x - 1) & 0x02) >> 1));
-        unsigned const at_bits = at_byte >> (((v >> 4) & 4) | ((v - 1) & 2));
+        unsigned const at_bits = hot.at_byte >> (((hot.v >> 4) & 4) | ((hot.v - 1) & 2));
 
-        at_latch_l = at_bits & 1;
-        at_latch_h = (at_bits >> 1) & 1;
+        hot.at_latch_l = at_bits & 1;
+        hot.at_latch_h = (at_bits >> 1) & 1;
     }
 }
 
 // Bumps the OAM and secondary OAM addresses, detecting overflow in either one
 static void move_to_next_oam_byte() {
-    oam_addr     = (oam_addr     + 1) & 0xFF;
-    sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+    hot.oam_addr     = (hot.oam_addr     + 1) & 0xFF;
+    hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
 
-    if (oam_addr == 0)
-        oam_addr_overflow = true;
+    if (hot.oam_addr == 0)
+        hot.oam_addr_overflow = true;
 
-    if (sec_oam_addr == 0) {
-        sec_oam_addr_overflow = true;
+    if (hot.sec_oam_addr == 0) {
+        hot.sec_oam_addr_overflow = true;
         // If sec_oam_addr becomes zero, eight sprites have been found, and we
         // enter overflow glitch mode
-        overflow_detection = true;
+        hot.overflow_detection = true;
     }
 }
 
@@ -439,69 +543,69 @@ static void move_to_next_oam_byte() {
 static void do_sprite_evaluation() {
     if (dot == 65) {
         // TODO: Should these be cleared even if rendering is disabled?
-        overflow_detection = oam_addr_overflow = sec_oam_addr_overflow = false;
-        sec_oam_addr = 0;
+        hot.overflow_detection = hot.oam_addr_overflow = hot.sec_oam_addr_overflow = false;
+        hot.sec_oam_addr = 0;
     }
 
     if (dot & 1) {
         // On odd ticks, data is read from OAM
-        oam_data = oam[oam_addr];
+        hot.oam_data = cold.oam[hot.oam_addr];
         return;
     }
 
     // We need the original value to implement sprite overflow checking. It
     // might get overwritten below.
-    uint8_t const orig_oam_data = oam_data;
+    uint8_t const orig_oam_data = hot.oam_data;
 
     // On even ticks, data is written into secondary OAM...
-    if (!(oam_addr_overflow || sec_oam_addr_overflow))
-        sec_oam[sec_oam_addr] = oam_data;
+    if (!(hot.oam_addr_overflow || hot.sec_oam_addr_overflow))
+        hot.sec_oam[hot.sec_oam_addr] = hot.oam_data;
     else
         // ...unless we have OAM or secondary OAM overflow, in which case we
         // get a read from secondary OAM instead
-        oam_data = sec_oam[sec_oam_addr];
+        hot.oam_data = hot.sec_oam[hot.sec_oam_addr];
 
-    if (copy_sprite_signal > 0) {
+    if (hot.copy_sprite_signal > 0) {
         // We're currently copying data for a sprite
-        --copy_sprite_signal;
+        --hot.copy_sprite_signal;
         move_to_next_oam_byte();
         return;
     }
 
     // Is the current sprite in range?
-    bool const in_range = (scanline - orig_oam_data) < (sprite_size == EIGHT_BY_EIGHT ? 8 : 16);
+    bool const in_range = (scanline - orig_oam_data) < (hot.sprite_size == EIGHT_BY_EIGHT ? 8 : 16);
     // At dot 66 we're evaluating sprite zero. This is how the hardware does it.
     if (dot == 66)
-        s0_on_next_scanline = in_range;
+        hot.s0_on_next_scanline = in_range;
 
-    if (in_range && !(oam_addr_overflow || sec_oam_addr_overflow)) {
+    if (in_range && !(hot.oam_addr_overflow || hot.sec_oam_addr_overflow)) {
         // In-range sprite found. Copy it.
-        copy_sprite_signal = 3;
+        hot.copy_sprite_signal = 3;
         move_to_next_oam_byte();
         return;
     }
 
     // Sprite is not in range (or we have OAM or secondary OAM overflow)
 
-    if (!overflow_detection) {
+    if (!hot.overflow_detection) {
         // Clear low bits, bump high (HW does this, even though the low
         // clearing wouldn't usually be noticeable)
-        oam_addr = (oam_addr + 4) & 0xFC;
-        if (oam_addr == 0)
-            oam_addr_overflow = true;
+        hot.oam_addr = (hot.oam_addr + 4) & 0xFC;
+        if (hot.oam_addr == 0)
+            hot.oam_addr_overflow = true;
     }
     else {
-        if (in_range && !oam_addr_overflow) {
-            sprite_overflow = true;
-            overflow_detection = false;
+        if (in_range && !hot.oam_addr_overflow) {
+            cold.sprite_overflow = true;
+            hot.overflow_detection = false;
         }
         else {
             // Glitchy oam_addr increment after exactly eight
             // sprites have been found:
             // http://wiki.nesdev.com/w/index.php/PPU_sprite_evaluation
-            oam_addr = ((oam_addr + 4) & 0xFC) | ((oam_addr + 1) & 3);
-            if ((oam_addr & 0xFC) == 0)
-                oam_addr_overflow = true;
+            hot.oam_addr = ((hot.oam_addr + 4) & 0xFC) | ((hot.oam_addr + 1) & 3);
+            if ((hot.oam_addr & 0xFC) == 0)
+                hot.oam_addr_overflow = true;
         }
     }
 }
@@ -525,18 +629,24 @@ static bool calc_sprite_tile_address(uint8_t y, uint8_t index, uint8_t attrib, b
     unsigned const diff        = scanline - y;
     unsigned const diff_y_flip = (attrib & 0x80) ? ~diff : diff;
 
-    if (sprite_size == EIGHT_BY_EIGHT) {
-        ppu_addr_bus = sprite_pat_addr + 16*index + 8*is_high + (diff_y_flip & 7);
+    if (hot.sprite_size == EIGHT_BY_EIGHT) {
+        set_ppu_addr_bus(hot.sprite_pat_addr + 16*index + 8*is_high + (diff_y_flip & 7));
         // Equivalent to diff >= 0 && diff < 8 due to unsigned arithmetic
         return diff < 8;
     }
     else { // EIGHT_BY_SIXTEEN
-        ppu_addr_bus = 0x1000*(index & 1) + 16*(index & 0xFE) + ((diff_y_flip & 8) << 1)
-                                          + 8*is_high + (diff_y_flip & 7);
+        set_ppu_addr_bus(0x1000*(index & 1) + 16*(index & 0xFE) + ((diff_y_flip & 8) << 1)
+                                             + 8*is_high + (diff_y_flip & 7));
         return diff < 16;
     }
 }
 
+// chr_pixels() for the pattern byte at ppu_addr_bus for sprite 'n', taking
+// horizontal flipping into account
+static uint64_t sprite_chr_pixels(unsigned n) {
+    return chr_pixels(sprite_chr_pages, ppu_addr_bus, hot.sprite_attribs[n] & 0x40);
+}
+
 // Initializes the sprite output units with the sprites that were copied into
 // the secondary OAM during sprite evaluation
 static void do_sprite_loading() {
@@ -544,14 +654,14 @@ static void do_sprite_loading() {
     unsigned const sprite_n = (dot - 257)/8;
 
     if (dot == 257)
-        sec_oam_addr = 0;
+        hot.sec_oam_addr = 0;
 
     // Sprite 0 flag timing:
     //  - s0_on_next_scanline is initialized at dot = 66.5-67 (during sprite
     //    evaluation for sprite 0)
     //  - It is copied over to s0_on_cur_scanline during dots
     //    257.5-258, 258.5-259, ..., 319.5-320
-    s0_on_cur_scanline = s0_on_next_scanline;
+    hot.s0_on_cur_scanline = hot.s0_on_next_scanline;
 
     switch ((dot - 1) % 8) {
 
@@ -561,51 +671,47 @@ static void do_sprite_loading() {
         // TODO: How does the sprite_y/index loading work in detail?
 
         // Dummy NT fetch
-        ppu_addr_bus = 0x2000 | (v & 0x0FFF);
+        set_ppu_addr_bus(0x2000 | (hot.v & 0x0FFF));
 
-        sprite_y = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        hot.sprite_y = hot.sec_oam[hot.sec_oam_addr];
+        hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
         break;
     case 1:
-        sprite_index = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        hot.sprite_index = hot.sec_oam[hot.sec_oam_addr];
+        hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
         break;
     case 2:
         // Dummy "AT" fetch, which is actually an NT fetch too
-        ppu_addr_bus = 0x2000 | (v & 0x0FFF);
+        set_ppu_addr_bus(0x2000 | (hot.v & 0x0FFF));
 
-        sprite_attribs[sprite_n] = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        hot.sprite_attribs[sprite_n] = hot.sec_oam[hot.sec_oam_addr];
+        hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
         break;
     case 3:
-        sprite_x[sprite_n] = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        hot.sprite_x[sprite_n] = hot.sec_oam[hot.sec_oam_addr];
+        hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
         break;
 
     // Load low sprite tile byte
 
     case 4:
-        sprite_in_range =
-          calc_sprite_tile_address(sprite_y, sprite_index, sprite_attribs[sprite_n], false);
+        hot.sprite_in_range =
+          calc_sprite_tile_address(hot.sprite_y, hot.sprite_index, hot.sprite_attribs[sprite_n], false);
         break;
     case 5:
-        sprite_pat_l[sprite_n] = sprite_in_range ? chr_ref(ppu_addr_bus) : 0;
-        // Horizontal flipping
-        if (sprite_attribs[sprite_n] & 0x40)
-            sprite_pat_l[sprite_n] = rev_byte(sprite_pat_l[sprite_n]);
+        hot.sprite_pixels[sprite_n] = (hot.sprite_pixels[sprite_n] & pixel_high_bits) |
+          (hot.sprite_in_range ? sprite_chr_pixels(sprite_n) : 0);
         break;
 
     // Load high sprite tile byte
 
     case 6:
-        sprite_in_range =
-          calc_sprite_tile_address(sprite_y, sprite_index, sprite_attribs[sprite_n], true);
+        hot.sprite_in_range =
+          calc_sprite_tile_address(hot.sprite_y, hot.sprite_index, hot.sprite_attribs[sprite_n], true);
         break;
     case 7:
-        sprite_pat_h[sprite_n] = sprite_in_range ? chr_ref(ppu_addr_bus) : 0;
-        // Horizontal flipping
-        if (sprite_attribs[sprite_n] & 0x40)
-            sprite_pat_h[sprite_n] = rev_byte(sprite_pat_h[sprite_n]);
+        hot.sprite_pixels[sprite_n] = (hot.sprite_pixels[sprite_n] & pixel_low_bits) |
+          (hot.sprite_in_range ? sprite_chr_pixels(sprite_n) << 1 : 0);
         break;
 
     default: UNREACHABLE
@@ -634,18 +740,18 @@ static void do_render_line_ops() {
     case 257 ... 320:
         // Possible optimization: Could be merged to save double decoding of dot
         do_sprite_loading();
-        oam_addr = 0;
+        hot.oam_addr = 0;
         if (dot == 257)
             copy_horiz();
         break;
 
     case 337: case 339:
         // Dummy NT fetches
-        ppu_addr_bus = 0x2000 | (v & 0xFFF);
+        set_ppu_addr_bus(0x2000 | (hot.v & 0xFFF));
         break;
 
     case 341:
-        sec_oam_addr = 0;
+        hot.sec_oam_addr = 0;
         break;
     }
 }
@@ -662,12 +768,12 @@ static void do_visible_line_ops() {
         case 1 ... 64:
             // Secondary OAM clear
             if (dot & 1)
-                oam_data = 0xFF;
+                hot.oam_data = 0xFF;
             else {
-                sec_oam[sec_oam_addr] = oam_data;
+                hot.sec_oam[hot.sec_oam_addr] = hot.oam_data;
                 // Should this be done when setting oam_data? Extremely
                 // obscure.
-                sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+                hot.sec_oam_addr = (hot.sec_oam_addr + 1) & 0x1F;
             }
             break;
 
@@ -680,8 +786,8 @@ static void do_visible_line_ops() {
 // Called for dots on line 241
 static void do_line_241_ops() {
     if (dot == 1) {
-        in_vblank = true;
-        set_nmi(nmi_on_vblank);
+        cold.in_vblank = true;
+        set_nmi(cold.nmi_on_vblank);
     }
 }
 
@@ -689,9 +795,9 @@ static void do_line_241_ops() {
 static void do_prerender_line_ops() {
     // This might be one tick off due to the possibility of reading the flags
     // really shortly after they are cleared in the preferred alignment
-    if (dot == 1) sprite_overflow = sprite_zero_hit = initial_frame = false;
+    if (dot == 1) cold.sprite_overflow = cold.sprite_zero_hit = cold.initial_frame = false;
     // TODO: Explain why the timing works out like this (and is it cycle-perfect?)
-    if (dot == 2) in_vblank = false;
+    if (dot == 2) cold.in_vblank = false;
 
     if (rendering_enabled) {
         do_render_line_ops();
@@ -701,22 +807,51 @@ static void do_prerender_line_ops() {
         // condition on the value the flag is initialized to - hence it
         // always becomes false.
         if (dot == 66)
-            s0_on_next_scanline = false;
+            hot.s0_on_next_scanline = false;
 
         if (dot >= 280 && dot <= 304)
             copy_vert();
     }
 }
 
+// Reports the PPU events the mapper listens for, limited to those in
+// PPU_EVENTS. See PPU_event.
+template<unsigned PPU_EVENTS>
+static void raise_mapper_ppu_events() {
+    // Other A12 transitions are reported from set_ppu_addr_bus()
+    if (PPU_EVENTS & mapper_ppu_events & (PPU_A12_RISE | PPU_A12_FALL)) {
+        if (hot.a12_check_pending) {
+            hot.a12_check_pending = false;
+            raise_a12_events();
+        }
+    }
+
+    if (PPU_EVENTS & mapper_ppu_events & PPU_LATCH_FETCH) {
+        // $0FDx, $0FEx, $1FDx, or $1FEx
+        unsigned const latch_bits = ppu_addr_bus & 0xEFF0;
+        bool const on_latch_addr = latch_bits == 0x0FD0 || latch_bits == 0x0FE0;
+        if (on_latch_addr || hot.prev_on_latch_addr)
+            report_ppu_event(PPU_LATCH_FETCH);
+        hot.prev_on_latch_addr = on_latch_addr;
+    }
+
+    if (PPU_EVENTS & mapper_ppu_events & PPU_RENDER_DOT) {
+        if (!rendering_enabled || (scanline >= 240 && scanline != prerender_line) ||
+            dot == 257 || dot == 321 || dot == 337)
+            report_ppu_event(PPU_RENDER_DOT);
+    }
+}
+
 // Runs the PPU for one dot.
 // Performance hotspot - ticks at ~5.3 MHz
 //
 // IS_PAL is set true for PAL emulation, with PRERENDER_LINE set accordingly to
 // the scanline number of the pre-render line (the final line of the frame).
 // These are also available as 'is_pal' and 'prerender_line', but kept as
-// compile-time constants here for performance.
-template<bool IS_PAL, unsigned PRERENDER_LINE>
-static void tick_ppu() {
+// compile-time constants here for performance. PPU_EVENTS is as for
+// tick_ppu().
+template<bool IS_PAL, unsigned PRERENDER_LINE, unsigned PPU_EVENTS>
+static void tick_ppu_generic() {
     ++ppu_cycle;
 
     // Move to next tick - doing this first mirrors how Visual 2C02 views it
@@ -729,23 +864,23 @@ static void tick_ppu() {
         case 240:
             frame_completed();
             // The PPU address bus mirrors v outside of rendering
-            ppu_addr_bus = v & 0x3FFF;
+            set_ppu_addr_bus(hot.v & 0x3FFF);
             break;
 
         case PRERENDER_LINE + 1:
             scanline = 0;
             if (!IS_PAL) {
-                if (rendering_enabled && odd_frame) ++dot;
-                odd_frame = !odd_frame;
+                if (rendering_enabled && cold.odd_frame) ++dot;
+                cold.odd_frame = !cold.odd_frame;
             }
         }
     }
 
-    if (pending_v_update > 0 && --pending_v_update == 0) {
-        v = t;
+    if (hot.pending_v_update > 0 && --hot.pending_v_update == 0) {
+        hot.v = hot.t;
         if ((scanline >= 240 && scanline < PRERENDER_LINE) || !rendering_enabled)
             // The PPU address bus mirrors v outside of rendering
-            ppu_addr_bus = v & 0x3FFF;
+            set_ppu_addr_bus(hot.v & 0x3FFF);
     }
 
     switch (scanline) {
@@ -754,17 +889,31 @@ static void tick_ppu() {
     case PRERENDER_LINE: do_prerender_line_ops();
     }
 
-    // Mapper-specific operations - usually to snoop on ppu_addr_bus
-    ppu_tick_callback();
+    // Mapper-specific operations - usually to snoop on ppu_addr_bus. Compiled
+    // out for mappers that don't listen for any events.
+    if (PPU_EVENTS & mapper_ppu_events)
+        raise_mapper_ppu_events<PPU_EVENTS>();
 }
 
-void tick_ntsc_ppu() {
-    tick_ppu<false, 261>();
+template<bool IS_PAL, unsigned PPU_EVENTS>
+void tick_ppu() {
+    tick_ppu_generic<IS_PAL, IS_PAL ? 311 : 261, PPU_EVENTS>();
 }
 
-void tick_pal_ppu() {
-    tick_ppu<true, 311>();
-}
+// Explicit instantiations. Needs to match the emulation loops set up in
+// init_cpu_for_rom().
+
+#define INSTANTIATE_TICK_PPU(events)          \
+  template void tick_ppu<false, events>();    \
+  template void tick_ppu<true , events>();
+
+INSTANTIATE_TICK_PPU(0)
+INSTANTIATE_TICK_PPU(PPU_A12_RISE | PPU_A12_FALL)
+INSTANTIATE_TICK_PPU(PPU_LATCH_FETCH)
+INSTANTIATE_TICK_PPU(PPU_RENDER_DOT)
+INSTANTIATE_TICK_PPU(PPU_ALL_EVENTS)
+
+#undef INSTANTIATE_TICK_PPU
 
 static void do_2007_post_access_bump() {
     if (rendering_enabled && (scanline < 240 || scanline == prerender_line)) {
@@ -776,62 +925,72 @@ static void do_2007_post_access_bump() {
     // The incrementation operation can touch the high bit even though it's not
     // used for addressing (it's the high bit of fine y)
     else {
-        v = (v + v_inc) & 0x7FFF;
-        // The PPU address bus mirrors v outside of rendering
-        ppu_addr_bus = v & 0x3FFF;
+        hot.v = (hot.v + cold.v_inc) & 0x7FFF;
+        // The PPU address bus mirrors v outside of rendering. We're not
+        // within tick_ppu() here, so A12 is checked at the end of the next
+        // dot.
+        ppu_addr_bus = hot.v & 0x3FFF;
+        hot.a12_check_pending = true;
     }
 }
 
 static uint8_t read_vram() {
     // Use ppu_open_bus to hold the result, updating it in the process
 
-    switch (v & 0x3FFF) {
+    switch (hot.v & 0x3FFF) {
 
     // Pattern tables
     case 0x0000 ... 0x1FFF:
-        ppu_open_bus = ppu_data_reg;
+        cold.ppu_open_bus = cold.ppu_data_reg;
         open_bus_refreshed();
-        ppu_data_reg = chr_ref(v);
+        cold.ppu_data_reg = chr_ref(hot.v);
         break;
 
     // Nametables
     case 0x2000 ... 0x3EFF:
-        ppu_open_bus = ppu_data_reg;
+        cold.ppu_open_bus = cold.ppu_data_reg;
         open_bus_refreshed();
-        ppu_data_reg = read_nt(v);
+        cold.ppu_data_reg = read_nt(hot.v);
         break;
 
     // Palettes
     case 0x3F00 ... 0x3FFF:
-        ppu_open_bus = get_open_bus_bits_7_to_6() |
-          (palettes[v & 0x1F] & grayscale_color_mask);
+        cold.ppu_open_bus = get_open_bus_bits_7_to_6() |
+          (hot.palettes[hot.v & 0x1F] & cold.grayscale_color_mask);
         open_bus_bits_5_to_0_refreshed();
 
         // The data register is updated with the nametable byte that would
         // appear "underneath" the palette
         // (http://wiki.nesdev.com/w/index.php/PPU_memory_map)
-        ppu_data_reg = read_nt(v);
+        cold.ppu_data_reg = read_nt(hot.v);
         break;
 
     // GCC doesn't seem to infer this
     default: UNREACHABLE
     }
 
-    if (initial_frame) {
-        ppu_data_reg = 0;
+    if (cold.initial_frame) {
+        cold.ppu_data_reg = 0;
         printf("Warning: Reading PPUDATA during initial frame, at (%u,%u)\n", scanline, dot);
     }
 
-    return ppu_open_bus;
+    return cold.ppu_open_bus;
 }
 
 static void write_vram(uint8_t val) {
-    switch (v & 0x3FFF) {
+    switch (hot.v & 0x3FFF) {
 
     // Pattern tables
-    case 0x0000 ... 0x1FFF: if (uses_chr_ram) chr_ref(v) = val; break;
+    case 0x0000 ... 0x1FFF:
+        if (uses_chr_ram) {
+            unsigned const offset = &chr_ref(hot.v) - chr_base;
+            chr_base[offset] = val;
+            mark_dirty(CHR_RAM_MEM, offset);
+            decode_chr_row(offset & ~8);
+        }
+        break;
     // Nametables
-    case 0x2000 ... 0x3EFF: write_nt(v, val); break;
+    case 0x2000 ... 0x3EFF: write_nt(hot.v, val); break;
     // Palettes
     case 0x3F00 ... 0x3FFF:
         {
@@ -845,7 +1004,7 @@ static void write_vram(uint8_t val) {
             0x00, 0x11, 0x12, 0x13, 0x04, 0x15, 0x16, 0x17,
             0x08, 0x19, 0x1A, 0x1B, 0x0C, 0x1D, 0x1E, 0x1F };
 
-        palettes[palette_write_mirror[v & 0x1F]] = palettes[v & 0x1F] = val & 0x3F;
+        hot.palettes[palette_write_mirror[hot.v & 0x1F]] = hot.palettes[hot.v & 0x1F] = val & 0x3F;
         break;
         }
     // GCC doesn't seem to infer this
@@ -865,7 +1024,7 @@ uint8_t read_ppu_reg(unsigned n) {
             // VBlank flag is set. TODO: Elaborate on timing.
             switch (dot) {
             case 1:
-                in_vblank = false;
+                cold.in_vblank = false;
                 set_nmi(false);
                 break;
 
@@ -874,12 +1033,12 @@ uint8_t read_ppu_reg(unsigned n) {
                 break;
             }
         }
-        write_flip_flop = false;
-        ppu_open_bus    = (in_vblank << 7) | (sprite_zero_hit << 6) | (sprite_overflow << 5) |
-                          get_open_bus_bits_4_to_0();
-        in_vblank       = false;
+        cold.write_flip_flop = false;
+        cold.ppu_open_bus    = (cold.in_vblank << 7) | (cold.sprite_zero_hit << 6) | (cold.sprite_overflow << 5) |
+                               get_open_bus_bits_4_to_0();
+        cold.in_vblank       = false;
         open_bus_bits_7_to_5_refreshed();
-        return ppu_open_bus;
+        return cold.ppu_open_bus;
 
     case 4:
         {
@@ -888,14 +1047,14 @@ uint8_t read_ppu_reg(unsigned n) {
             // TODO: Make this work automagically through proper emulation of
             // the interval after the sprite fetches
             if (dot >= 323)
-                return sec_oam[0];
-            return oam_data;
+                return hot.sec_oam[0];
+            return hot.oam_data;
         }
         open_bus_refreshed();
 
         // Some of the attribute bits do not exist and always read back as zero
         static uint8_t const mask_lut[] = { 0xFF, 0xFF, 0xE3, 0xFF };
-        return ppu_open_bus = oam[oam_addr] & mask_lut[oam_addr & 3];
+        return cold.ppu_open_bus = cold.oam[hot.oam_addr] & mask_lut[hot.oam_addr & 3];
         }
 
     case 7:
@@ -917,19 +1076,33 @@ void write_oam_data_reg(uint8_t val) {
     // status for example) and not worth emulating.
     if (rendering_enabled && (scanline < 240 || scanline == prerender_line))
         return;
-    oam[oam_addr++] = val;
+    cold.oam[hot.oam_addr++] = val;
+}
+
+bool oam_idle_for_dots(unsigned dots) {
+    if (!rendering_enabled)
+        return true;
+    if (scanline < 240 || scanline >= prerender_line)
+        return false;
+    // Dots left until the pre-render line
+    return 341*(prerender_line - scanline) - dot > dots;
+}
+
+void write_oam_page(uint8_t const *data) {
+    for (unsigned i = 0; i < 256; ++i)
+        cold.oam[hot.oam_addr++] = data[i];
 }
 
 static void set_derived_ppumask_vars() {
-    rendering_enabled = show_bg || show_sprites;
-    bg_clip_comp      = !show_bg      ? 256 : show_bg_left_8      ? 0 : 8;
-    sprite_clip_comp  = !show_sprites ? 256 : show_sprites_left_8 ? 0 : 8;
+    rendering_enabled    = cold.show_bg || cold.show_sprites;
+    hot.bg_clip_comp     = !cold.show_bg      ? 256 : cold.show_bg_left_8      ? 0 : 8;
+    hot.sprite_clip_comp = !cold.show_sprites ? 256 : cold.show_sprites_left_8 ? 0 : 8;
     // The status of the tint bits determines the current palette
-    pal_to_rgb        = nes_to_rgb[tint_bits];
+    pal_to_rgb           = nes_to_rgb[cold.tint_bits];
 }
 
 void write_ppu_reg(uint8_t val, unsigned n) {
-    ppu_open_bus = val;
+    cold.ppu_open_bus = val;
     open_bus_refreshed();
 
     switch (n) {
@@ -937,17 +1110,17 @@ void write_ppu_reg(uint8_t val, unsigned n) {
     // PPUCTRL
     case 0:
         {
-        if (initial_frame) {
+        if (cold.initial_frame) {
             printf("Warning: Writing PPUCTRL during initial frame, at (%u,%u)\n", scanline, dot);
             return;
         }
 
         // t: ... AB.. .... .... = value: .... ..AB
-        t               = (t & 0x73FF) | ((val & 0x03) << 10);
-        v_inc           = (val & 0x04) ? 32 : 1;
-        sprite_pat_addr = (val & 0x08) << 9; // val & 0x08 ? 0x1000 : 0x0000
-        bg_pat_addr     = (val & 0x10) << 8; // val & 0x10 ? 0x1000 : 0x0000
-        sprite_size     = val & 0x20 ? EIGHT_BY_SIXTEEN : EIGHT_BY_EIGHT;
+        hot.t               = (hot.t & 0x73FF) | ((val & 0x03) << 10);
+        cold.v_inc          = (val & 0x04) ? 32 : 1;
+        hot.sprite_pat_addr = (val & 0x08) << 9; // val & 0x08 ? 0x1000 : 0x0000
+        hot.bg_pat_addr     = (val & 0x10) << 8; // val & 0x10 ? 0x1000 : 0x0000
+        hot.sprite_size     = val & 0x20 ? EIGHT_BY_SIXTEEN : EIGHT_BY_EIGHT;
 
         bool const new_nmi_on_vblank = val & 0x80;
         if (new_nmi_on_vblank) {
@@ -955,7 +1128,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
             // set causes another NMI to be generated, since the NMI line
             // equals nmi_on_vblank AND in_vblank (though it's active low
             // instead): http://wiki.nesdev.com/w/index.php/NMI
-            if (!nmi_on_vblank && in_vblank)
+            if (!cold.nmi_on_vblank && cold.in_vblank)
                 set_nmi(true);
         }
         else
@@ -964,23 +1137,23 @@ void write_ppu_reg(uint8_t val, unsigned n) {
             // pulse in that case, but it won't be seen.
             set_nmi(false);
 
-        nmi_on_vblank = new_nmi_on_vblank;
+        cold.nmi_on_vblank = new_nmi_on_vblank;
         break;
         }
 
     // PPUMASK
     case 1:
-        if (initial_frame) {
+        if (cold.initial_frame) {
             printf("Warning: Writing PPUMASK during initial frame, at (%u,%u)\n", scanline, dot);
             return;
         }
 
-        grayscale_color_mask = val & 0x01 ? 0x30 : 0x3F;
-        show_bg_left_8       = val & 0x02;
-        show_sprites_left_8  = val & 0x04;
-        show_bg              = val & 0x08;
-        show_sprites         = val & 0x10;
-        tint_bits            = (val >> 5) & 7;
+        cold.grayscale_color_mask = val & 0x01 ? 0x30 : 0x3F;
+        cold.show_bg_left_8       = val & 0x02;
+        cold.show_sprites_left_8  = val & 0x04;
+        cold.show_bg              = val & 0x08;
+        cold.show_sprites         = val & 0x10;
+        cold.tint_bits            = (val >> 5) & 7;
 
         set_derived_ppumask_vars();
 
@@ -990,54 +1163,54 @@ void write_ppu_reg(uint8_t val, unsigned n) {
     case 2: break;
 
     // OAMADDR
-    case 3: oam_addr = val; break;
+    case 3: hot.oam_addr = val; break;
 
     // OAMDATA
     case 4: write_oam_data_reg(val); break;
 
     // PPUSCROLL
     case 5:
-        if (initial_frame) {
+        if (cold.initial_frame) {
             printf("Warning: Writing PPUSCROLL during initial frame, at (%u,%u)\n", scanline, dot);
             return;
         }
 
-        if (!write_flip_flop) {
+        if (!cold.write_flip_flop) {
             // First write
             // fine_x = val: .... .ABC
             // t: ... .... ...D EFGH = val: DEFG H...
-            fine_x = val & 7;
-            t      = (t & 0x7FE0) | ((val & 0xF8) >> 3);
+            hot.fine_x = val & 7;
+            hot.t      = (hot.t & 0x7FE0) | ((val & 0xF8) >> 3);
         }
         else
             // Second write
             // t: ABC ..DE FGH. .... = val: DEFG HABC
-            t = (t & 0x0C1F) | ((val & 0xF8) << 2) | ((val & 7) << 12);
+            hot.t = (hot.t & 0x0C1F) | ((val & 0xF8) << 2) | ((val & 7) << 12);
 
-        write_flip_flop = !write_flip_flop;
+        cold.write_flip_flop = !cold.write_flip_flop;
         break;
 
     // PPUADDR
     case 6:
-        if (initial_frame) {
+        if (cold.initial_frame) {
             printf("Warning: Writing PPUADDR during initial frame, at (%u,%u)\n", scanline, dot);
             return;
         }
 
-        if (!write_flip_flop)
+        if (!cold.write_flip_flop)
             // First write
             // t: 0AB CDEF .... .... = val: ..AB CDEF
             // Clearing of high bit confirmed in Visual 2C02
-            t = (t & 0x00FF) | ((val & 0x3F) << 8);
+            hot.t = (hot.t & 0x00FF) | ((val & 0x3F) << 8);
         else {
             // Second write
             // t: ... .... ABCD EFGH = val: ABCD EFGH
-            t = (t & 0x7F00) | val;
+            hot.t = (hot.t & 0x7F00) | val;
             // There is a delay of ~3 ticks before t is copied to v
-            pending_v_update = 3;
+            hot.pending_v_update = 3;
         }
 
-        write_flip_flop = !write_flip_flop;
+        cold.write_flip_flop = !cold.write_flip_flop;
         break;
 
     // PPUDATA
@@ -1056,20 +1229,20 @@ void write_ppu_reg(uint8_t val, unsigned n) {
 
 static void clear_2000() {
     // $2000
-    v_inc           = 1;
-    sprite_pat_addr = bg_pat_addr = 0x0000;
-    sprite_size     = EIGHT_BY_EIGHT;
-    nmi_on_vblank   = false;
+    cold.v_inc          = 1;
+    hot.sprite_pat_addr = hot.bg_pat_addr = 0x0000;
+    hot.sprite_size     = EIGHT_BY_EIGHT;
+    cold.nmi_on_vblank  = false;
 }
 
 static void clear_2001() {
-    grayscale_color_mask = 0x3F; // Grayscale off
-    show_bg_left_8       = show_sprites_left_8 = false;
-    show_bg              = show_sprites        = false;
-    tint_bits            = 0;
-    pal_to_rgb           = nes_to_rgb[tint_bits];
-    rendering_enabled    = false;
-    bg_clip_comp         = sprite_clip_comp = 256;
+    cold.grayscale_color_mask = 0x3F; // Grayscale off
+    cold.show_bg_left_8       = cold.show_sprites_left_8 = false;
+    cold.show_bg              = cold.show_sprites        = false;
+    cold.tint_bits            = 0;
+    pal_to_rgb                = nes_to_rgb[cold.tint_bits];
+    rendering_enabled         = false;
+    hot.bg_clip_comp          = hot.sprite_clip_comp = 256;
 }
 
 void set_ppu_cold_boot_state() {
@@ -1078,65 +1251,65 @@ void set_ppu_cold_boot_state() {
 
     // This makes the uninitialized background color the "NES gray" seen on
     // startup in many games, so it's probably correct(ish)
-    init_array(palettes, (uint8_t)0);
+    init_array(hot.palettes, (uint8_t)0);
     // Make all sprites out-of-range by default to prevent temporary glitching.
     // On the real thing the values might be indeterminate.
-    init_array(oam    , (uint8_t)0xFF);
-    init_array(sec_oam, (uint8_t)0xFF);
+    init_array(cold.oam   , (uint8_t)0xFF);
+    init_array(hot.sec_oam, (uint8_t)0xFF);
 
     // Loopy regs
-    fine_x = t = v = 0;
+    hot.fine_x = hot.t = hot.v = 0;
 
     clear_2000();
     clear_2001();
 
     // $2002
-    sprite_overflow = sprite_zero_hit = in_vblank = false;
+    cold.sprite_overflow = cold.sprite_zero_hit = cold.in_vblank = false;
 
     // OAM regs
-    oam_addr = sec_oam_addr = oam_data = 0;
+    hot.oam_addr = hot.sec_oam_addr = hot.oam_data = 0;
 
     // Sprite evaluation state
 
-    copy_sprite_signal = 0;
-    oam_addr_overflow  = sec_oam_addr_overflow = false;
-    overflow_detection = false;
+    hot.copy_sprite_signal = 0;
+    hot.oam_addr_overflow  = hot.sec_oam_addr_overflow = false;
+    hot.overflow_detection = false;
 
     // Misc. regs and helpers
-    write_flip_flop     = false;
-    ppu_data_reg        = 0;
-    pending_v_update    = 0;     // No pending v update
-    odd_frame           = false; // Initial frame is even
-    initial_frame       = starts_on_initial_frame;
-    s0_on_next_scanline = s0_on_cur_scanline = false;
-    ppu_addr_bus        = 0;
-    dot                 = scanline = ppu_cycle = 0;
+    cold.write_flip_flop    = false;
+    cold.ppu_data_reg       = 0;
+    hot.pending_v_update    = 0;     // No pending v update
+    cold.odd_frame          = false; // Initial frame is even
+    cold.initial_frame      = starts_on_initial_frame;
+    hot.s0_on_next_scanline = hot.s0_on_cur_scanline = false;
+    ppu_addr_bus            = 0;
+    hot.prev_a12_high       = hot.a12_check_pending = hot.prev_on_latch_addr = false;
+    dot                     = scanline = ppu_cycle = 0;
 
     // Open bus
 
-    ppu_open_bus = 0;
-    ppu_bit_7_to_6_write_cycle = ppu_bit_5_write_cycle = ppu_bit_4_to_0_write_cycle = 0;
+    cold.ppu_open_bus = 0;
+    cold.ppu_bit_7_to_6_write_cycle = cold.ppu_bit_5_write_cycle = cold.ppu_bit_4_to_0_write_cycle = 0;
 
     // Render pipeline buffers and shift registers and sprite output units
 
-    nt_byte    = at_byte    = 0;
-    bg_byte_l  = bg_byte_h  = 0;
-    bg_shift_l = bg_shift_h = 0;
-    at_shift_l = at_shift_h = 0;
-    at_latch_l = at_latch_h = 0;
+    hot.nt_byte    = hot.at_byte = 0;
+    hot.bg_row     = 0;
+    hot.bg_pixels  = hot.bg_pixels_next = 0;
+    hot.at_shift_l = hot.at_shift_h = 0;
+    hot.at_latch_l = hot.at_latch_h = 0;
 
-    sprite_y = sprite_index = 0;
-    sprite_in_range = false;
+    hot.sprite_y = hot.sprite_index = 0;
+    hot.sprite_in_range = false;
 
-    init_array(sprite_attribs, (uint8_t)0);
-    init_array(sprite_x      , (uint8_t)0);
-    init_array(sprite_pat_l  , (uint8_t)0);
-    init_array(sprite_pat_h  , (uint8_t)0);
+    init_array(hot.sprite_attribs, (uint8_t)0);
+    init_array(hot.sprite_x      , (uint8_t)0);
+    init_array(hot.sprite_pixels , (uint64_t)0);
 }
 
 void reset_ppu() {
     // Loopy regs
-    fine_x = t = 0;
+    hot.fine_x = hot.t = 0;
 
     clear_2000();
     clear_2001();
@@ -1144,12 +1317,12 @@ void reset_ppu() {
     // 2002 is probably unchanged since the reset signal isn't tied to any of
     // the flip-flops
 
-    write_flip_flop = false;
+    cold.write_flip_flop = false;
     dot = scanline = 0;
-    odd_frame = false;
+    cold.odd_frame = false;
 
-    sprite_y = sprite_index = 0;
-    sprite_in_range = false;
+    hot.sprite_y = hot.sprite_index = 0;
+    hot.sprite_in_range = false;
 }
 
 // State transfers
@@ -1157,71 +1330,20 @@ void reset_ppu() {
 template<bool calculating_size, bool is_save>
 void transfer_ppu_state(uint8_t *&buf) {
     #define T(x) transfer<calculating_size, is_save>(x, buf);
-    #define T_MEM(x, len) transfer_mem<calculating_size, is_save>(x, len, buf);
-
-    if (uses_chr_ram) T_MEM(chr_base, 0x2000);
-    T_MEM(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
-    T(palettes)
-    T(oam) T(sec_oam)
-    T(t) T(v) T(fine_x)
-    T(pending_v_update)
-
-    T(v_inc)
-    T(sprite_pat_addr)
-    T(bg_pat_addr)
-    T(sprite_size)
-    T(nmi_on_vblank)
-
-    T(grayscale_color_mask)
-    T(show_bg_left_8)
-    T(show_sprites_left_8)
-    T(show_bg)
-    T(show_sprites)
-    T(tint_bits)
-    if (!is_save)
-        set_derived_ppumask_vars();
 
-    T(sprite_overflow) T(sprite_zero_hit) T(in_vblank)
+    // CHR RAM and CIRAM are transferred by transfer_system_state(), as
+    // rewind saves them incrementally
 
-    T(oam_addr) T(sec_oam_addr) T(oam_data)
-
-    T(copy_sprite_signal)
-    T(oam_addr_overflow) T(sec_oam_addr_overflow)
-    T(overflow_detection)
+    T(hot)
+    T(cold)
+    if (!is_save)
+        set_derived_ppumask_vars();
 
-    T(write_flip_flop)
-    T(ppu_data_reg)
-    T(odd_frame)
     T(ppu_cycle)
-
     T(dot) T(scanline)
-
-    T(nt_byte) T(at_byte)
-    T(bg_byte_l) T(bg_byte_h)
-    T(bg_shift_l) T(bg_shift_h)
-    T(at_shift_l) T(at_shift_h)
-    T(at_latch_l) T(at_latch_h)
-
-    T(sprite_attribs)
-    T(sprite_x)
-    T(sprite_pat_l)
-    T(sprite_pat_h)
-
-    T(s0_on_next_scanline)
-    T(s0_on_cur_scanline)
-
-    T(sprite_y) T(sprite_index)
-    T(sprite_in_range)
-
-    T(initial_frame)
-
     T(ppu_addr_bus)
 
-    T(ppu_open_bus)
-    T(ppu_bit_7_to_6_write_cycle) T(ppu_bit_5_write_cycle) T(ppu_bit_4_to_0_write_cycle)
-
     #undef T
-    #undef T_MEM
 }
 
 // Explicit instantiations
@@ -1,13 +1,24 @@
 void    init_ppu_for_rom();
 
-void    tick_ntsc_ppu();
-void    tick_pal_ppu();
+// Runs the PPU for one dot. PPU_EVENTS is the set of PPU_event values that can
+// be reported to the mapper. Instantiated for PPU_ALL_EVENTS and for the sets
+// used by the supported mappers.
+template<bool IS_PAL, unsigned PPU_EVENTS>
+void    tick_ppu();
 
 void    set_ppu_cold_boot_state();
 void    reset_ppu();
 uint8_t read_ppu_reg(unsigned n);
 void    write_ppu_reg(uint8_t value, unsigned n);
 void    write_oam_data_reg(uint8_t value);
+// Returns true if OAM writes will go through and OAM won't be looked at by
+// the PPU during the next 'dots' dots
+bool    oam_idle_for_dots(unsigned dots);
+// Does 256 $2004 writes. Only valid if the PPU isn't looking at OAM.
+void    write_oam_page(uint8_t const *data);
+// Updates decoded_chr[] for the CHR bytes in [offset, offset + len), which
+// must be 16-byte aligned
+void    decode_chr(unsigned offset, unsigned len);
 
 enum Sprite_size { EIGHT_BY_EIGHT = 0, EIGHT_BY_SIXTEEN };
 
@@ -15,6 +26,7 @@ extern unsigned prerender_line;
 extern unsigned scanline, dot;
 extern unsigned ppu_addr_bus;
 extern uint8_t *ciram;
+extern uint64_t *decoded_chr;
 extern uint64_t ppu_cycle;
 extern bool     rendering_enabled;
 
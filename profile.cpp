@@ -0,0 +1,132 @@
+#include "common.h"
+
+#include "profile.h"
+#include "timing.h"
+
+#include <time.h>
+
+uint64_t prof_frame_cycles[N_PROF_SECTIONS];
+
+unsigned const prof_report_interval = 600; // ~10 seconds for NTSC
+
+// Statistics are kept for the sections plus two derived values: the length of
+// the entire frame, and the CPU's share of it (see profile.h)
+enum {
+    STAT_FRAME = N_PROF_SECTIONS,
+    STAT_CPU,
+
+    N_STATS
+};
+
+static char const *const stat_names[N_STATS] =
+  { "ppu", "mapper_event", "apu", "draw", "audio", "rewind", "sleep",
+    "frame", "cpu" };
+
+struct Stat {
+    uint64_t total, min, max;
+};
+
+// Statistics for the whole run
+static Stat     run_stats[N_STATS];
+static uint64_t n_frames;
+
+// Totals for the current reporting interval
+static uint64_t interval_totals[N_STATS];
+static unsigned n_interval_frames;
+
+// TSC value at the end of the previous frame. Zero before the first frame.
+static uint64_t prev_frame_end;
+
+// Used to calibrate the TSC against the monotonic clock
+static uint64_t start_tsc;
+static timespec start_time;
+
+static double tsc_mhz() {
+    timespec now;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &now) == -1,
+      "failed to fetch profiling timestamp from clock_gettime()");
+    double const micros = 1e6*(now.tv_sec - start_time.tv_sec) +
+                          (now.tv_nsec - start_time.tv_nsec)/1e3;
+    return micros > 0 ? (__rdtsc() - start_tsc)/micros : 0;
+}
+
+// Emulation speed relative to real time given the cycles spent on the frame
+// excluding sleep
+static double speed(double busy_cycles, double mhz) {
+    return busy_cycles > 0 ? (nanos_per_frame*mhz/1e3)/busy_cycles : 0;
+}
+
+void prof_end_frame() {
+    uint64_t const now = __rdtsc();
+
+    if (prev_frame_end == 0) {
+        // Start measuring from the end of the first frame, which gives whole
+        // frames from here on
+        start_tsc = prev_frame_end = now;
+        errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &start_time) == -1,
+          "failed to fetch profiling timestamp from clock_gettime()");
+        init_array(prof_frame_cycles, (uint64_t)0);
+        return;
+    }
+
+    uint64_t frame[N_STATS];
+    memcpy(frame, prof_frame_cycles, sizeof prof_frame_cycles);
+    frame[STAT_FRAME] = now - prev_frame_end;
+    // Whatever isn't accounted for by the non-nested sections is the CPU's
+    uint64_t accounted = 0;
+    for (unsigned i = 0; i < N_PROF_SECTIONS; ++i)
+        if (i != PROF_MAPPER_EVENT)
+            accounted += frame[i];
+    frame[STAT_CPU] = frame[STAT_FRAME] > accounted ? frame[STAT_FRAME] - accounted : 0;
+
+    for (unsigned i = 0; i < N_STATS; ++i) {
+        Stat &stat = run_stats[i];
+        if (n_frames == 0)
+            stat.min = stat.max = frame[i];
+        else {
+            stat.min = min(stat.min, frame[i]);
+            stat.max = max(stat.max, frame[i]);
+        }
+        stat.total += frame[i];
+        interval_totals[i] += frame[i];
+    }
+    ++n_frames;
+
+    init_array(prof_frame_cycles, (uint64_t)0);
+    prev_frame_end = now;
+
+    if (++n_interval_frames == prof_report_interval) {
+        double const mhz = tsc_mhz();
+        fprintf(stderr, "prof frames=%" PRIu64 " tsc_mhz=%.1f", n_frames, mhz);
+        // Frame and CPU first, as they're the most interesting
+        for (unsigned i = N_STATS; i-- > 0; )
+            fprintf(stderr, " %s=%" PRIu64, stat_names[i],
+                    interval_totals[i]/n_interval_frames);
+        fprintf(stderr, " speed=%.2f\n",
+                speed((double)(interval_totals[STAT_FRAME] - interval_totals[PROF_SLEEP])/
+                        n_interval_frames, mhz));
+
+        init_array(interval_totals, (uint64_t)0);
+        n_interval_frames = 0;
+    }
+}
+
+void print_prof_stats() {
+    if (n_frames == 0)
+        return;
+
+    double const mhz = tsc_mhz();
+    uint64_t const busy =
+      run_stats[STAT_FRAME].total - run_stats[PROF_SLEEP].total;
+
+    printf("Profile over %" PRIu64 " frames (TSC at %.1f MHz, cycles per frame, "
+           "share of non-sleep time):\n", n_frames, mhz);
+    printf("  %-13s %12s %7s %12s %12s\n", "section", "avg", "share", "min", "max");
+    for (unsigned i = N_STATS; i-- > 0; ) {
+        Stat const &stat = run_stats[i];
+        printf("  %-13s %12" PRIu64 " %6.1f%% %12" PRIu64 " %12" PRIu64 "\n",
+               stat_names[i], stat.total/n_frames,
+               busy > 0 ? 100.0*stat.total/busy : 0.0, stat.min, stat.max);
+    }
+    printf("Emulation speed: %.2fx real time\n", speed((double)busy/n_frames, mhz));
+}
@@ -0,0 +1,55 @@
+// Optional per-subsystem profiling, enabled with PROFILE=1 in the Makefile
+//
+// Sections are timed with rdtsc and the deltas summed per frame. At the end
+// of each frame the sums are folded into per-frame min/max/total statistics,
+// so the per-call cost is two rdtsc's and an add. Without PROFILE, the macros
+// expand to nothing.
+//
+// Sections may nest (mapper events happen within PPU ticks), and the numbers
+// for a section include the nested ones. The CPU has no section of its own -
+// it gets whatever is left of the frame after the other sections and the
+// sleep at the end of the frame.
+
+#ifdef PROFILE
+
+#include <x86intrin.h>
+
+enum Prof_section {
+    PROF_PPU,          // tick_ppu() (per CPU cycle, so covers ~3 dots)
+    PROF_MAPPER_EVENT, // Mapper PPU event callbacks (nested in PROF_PPU)
+    PROF_APU,          // tick_apu()
+    PROF_DRAW,         // draw_frame()
+    PROF_AUDIO,        // end_audio_frame()
+    PROF_REWIND,       // push_state()
+    PROF_SLEEP,        // Frame pacing
+
+    N_PROF_SECTIONS
+};
+
+// Cycles spent in each section during the current frame
+extern uint64_t prof_frame_cycles[N_PROF_SECTIONS];
+
+#  define PROF_BEGIN(section) uint64_t const prof_begin_##section = __rdtsc()
+#  define PROF_END(section) \
+     prof_frame_cycles[section] += __rdtsc() - prof_begin_##section
+
+// Call at the end of each frame. Every prof_report_interval frames, prints a
+// machine-readable line to stderr:
+//
+//   prof frames=<n> tsc_mhz=<f> frame=<c> cpu=<c> ppu=<c> ... speed=<f>
+//
+// where each <c> is the average number of TSC cycles per frame over the
+// interval and speed is the emulation speed relative to real time, had the
+// frame not been slept through.
+void prof_end_frame();
+
+// Prints a summary (cycles and share of emulation time per section, with
+// min/max per frame) for the whole run
+void print_prof_stats();
+
+#else
+
+#  define PROF_BEGIN(section)
+#  define PROF_END(section)
+
+#endif
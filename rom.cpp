@@ -2,17 +2,21 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "cpu.h"
 #include "mapper.h"
 #ifdef RECORD_MOVIE
 #  include "movie.h"
 #endif
-#include "md5.h"
 #include "ppu.h"
 #include "rom.h"
+#include "rom_db.h"
 #include "save_states.h"
 #include "timing.h"
 
+// The ROM file, mapped read-only. prg_base and (for CHR ROM) chr_base point
+// into it.
 static uint8_t *rom_buf;
+static size_t   rom_buf_size;
 
 uint8_t        *prg_base;
 unsigned        prg_16k_banks;
@@ -47,17 +51,59 @@ char const *const mirroring_to_str[N_MIRRORING_MODES] =
     "four-screen",
     "special (internal error - should never get this here)" };
 
+bool filename_suggests_pal(char const *filename) {
+    return strstr(filename, "(E)") || strstr(filename, "PAL");
+}
+
+void parse_ines_header(uint8_t const *buf, Ines_header &header) {
+    header.prg_16k_banks = buf[4];
+    header.chr_8k_banks  = buf[5];
+
+    // Possibly updated with the high nibble below
+    header.mapper = buf[6] >> 4;
+
+    header.in_ines_2_0_format = (buf[7] & 0x0C) == 0x08;
+    // Assume we're dealing with a corrupted header (e.g. one containing
+    // "DiskDude!" in bytes 7-15) if the ROM is not in iNES 2.0 format and
+    // bytes 12-15 are not all zero
+    header.is_corrupted = !header.in_ines_2_0_format && memcmp(buf + 12, "\0\0\0\0", 4);
+    if (header.is_corrupted)
+        header.is_vs_unisystem = header.is_playchoice_10 = false;
+    else {
+        header.is_vs_unisystem  = buf[7] & 1;
+        header.is_playchoice_10 = buf[7] & 2;
+        header.mapper |= (buf[7] & 0xF0);
+    }
+
+    // If bit 3 of flag byte 6 is set, the cart contains 2 KB of additional
+    // CIRAM (nametable memory) and uses four-screen (linear) addressing
+    if (buf[6] & 8)
+        header.mirroring = FOUR_SCREEN;
+    else
+        header.mirroring = buf[6] & 1 ? VERTICAL : HORIZONTAL;
+
+    header.has_battery = buf[6] & 2;
+    header.has_trainer = buf[6] & 4;
+}
+
+size_t ines_min_size(Ines_header const &header) {
+    return 16 + 512*header.has_trainer +
+      0x4000*header.prg_16k_banks + 0x2000*header.chr_8k_banks;
+}
+
+// Database entry for the loaded ROM, or null if it isn't in the database
+static Rom_db_entry const *db_entry;
+
 // Forward declaration
-static void do_rom_specific_overrides();
+static void do_rom_specific_overrides(uint64_t hash);
 
 void load_rom(char const *filename, bool print_info) {
     #define PRINT_INFO(...) do { if (print_info) printf(__VA_ARGS__); } while(0)
 
-    is_pal = strstr(filename, "(E)") || strstr(filename, "PAL");
+    is_pal = filename_suggests_pal(filename);
     PRINT_INFO("Guessing %s based on filename\n", is_pal ? "PAL" : "NTSC");
 
-    size_t rom_buf_size;
-    rom_buf = get_file_buffer(filename, rom_buf_size);
+    rom_buf = map_file(filename, rom_buf_size);
 
     fail_if(rom_buf_size < 16,
       "'%s' is too short to be a valid iNES file "
@@ -69,8 +115,11 @@ void load_rom(char const *filename, bool print_info) {
       "(the corresponding bytes are instead 0x%02X, 0x%02X, 0x%02X, 0x%02X)",
       filename, rom_buf[0], rom_buf[1], rom_buf[2], rom_buf[3]);
 
-    prg_16k_banks = rom_buf[4];
-    chr_8k_banks  = rom_buf[5];
+    Ines_header header;
+    parse_ines_header(rom_buf, header);
+
+    prg_16k_banks = header.prg_16k_banks;
+    chr_8k_banks  = header.chr_8k_banks;
     PRINT_INFO("PRG ROM size: %u KB\nCHR ROM size: %u KB\n", 16*prg_16k_banks, 8*chr_8k_banks);
 
     fail_if(prg_16k_banks == 0, // TODO: This makes sense for iNES 2.0
@@ -80,7 +129,7 @@ void load_rom(char const *filename, bool print_info) {
 
     // Check if the ROM is large enough to hold all the banks
 
-    size_t const min_size = 16 + 512*has_trainer + 0x4000*prg_16k_banks + 0x2000*chr_8k_banks;
+    size_t const min_size = ines_min_size(header);
     if (rom_buf_size < min_size) {
         char chr_msg[18]; // sizeof(" + xxx*8192 (CHR)")
         if (chr_8k_banks)
@@ -90,46 +139,33 @@ void load_rom(char const *filename, bool print_info) {
         fail("'%s' is too short to hold the specified number of PRG (program data) and CHR (graphics data) "
           "banks - is %zu bytes, expected at least %zu bytes (16 (header) + %s%u*16384 (PRG)%s)",
           filename, rom_buf_size, min_size,
-          has_trainer ? "512 (trainer) + " : "",
+          header.has_trainer ? "512 (trainer) + " : "",
           prg_16k_banks,
           chr_msg);
     }
 
-    // Possibly updated with the high nibble below
-    mapper = rom_buf[6] >> 4;
-
-    bool const in_ines_2_0_format = (rom_buf[7] & 0x0C) == 0x08;
-    PRINT_INFO(in_ines_2_0_format ? "in iNES 2.0 format\n" : "not in iNES 2.0 format\n");
-    // Assume we're dealing with a corrupted header (e.g. one containing
-    // "DiskDude!" in bytes 7-15) if the ROM is not in iNES 2.0 format and
-    // bytes 12-15 are not all zero
-    if (!in_ines_2_0_format && memcmp(rom_buf + 12, "\0\0\0\0", 4))
+    PRINT_INFO(header.in_ines_2_0_format ? "in iNES 2.0 format\n" : "not in iNES 2.0 format\n");
+    if (header.is_corrupted)
         PRINT_INFO("header looks corrupted (bytes 12-15 not all zero) - ignoring byte 7\n");
-    else {
-        is_vs_unisystem  = rom_buf[7] & 1;
-        is_playchoice_10 = rom_buf[7] & 2;
-        mapper |= (rom_buf[7] & 0xF0);
-    }
 
+    mapper           = header.mapper;
+    is_vs_unisystem  = header.is_vs_unisystem;
+    is_playchoice_10 = header.is_playchoice_10;
     PRINT_INFO("mapper: %u\n", mapper);
 
+    mirroring = (Mirroring)header.mirroring;
 
-    // If bit 3 of flag byte 6 is set, the cart contains 2 KB of additional
-    // CIRAM (nametable memory) and uses four-screen (linear) addressing
-    if (rom_buf[6] & 8)
-        mirroring = FOUR_SCREEN;
-    else
-        mirroring = rom_buf[6] & 1 ? VERTICAL : HORIZONTAL;
-
-    if ((has_battery = rom_buf[6] & 2)) PRINT_INFO("has battery\n");
-    if ((has_trainer = rom_buf[6] & 4)) PRINT_INFO("has trainer\n");
+    if ((has_battery = header.has_battery)) PRINT_INFO("has battery\n");
+    if ((has_trainer = header.has_trainer)) PRINT_INFO("has trainer\n");
 
     prg_base = rom_buf + 16 + 512*has_trainer;
 
     // Default
     has_bus_conflicts = false;
 
-    do_rom_specific_overrides();
+    uint64_t const hash = rom_hash(prg_base, 0x4000*prg_16k_banks + 0x2000*chr_8k_banks);
+    PRINT_INFO("ROM hash: %016" PRIx64 "\n", hash);
+    do_rom_specific_overrides(hash);
     // Needs to come after a possible override
     prerender_line = is_pal ? 311 : 261;
 
@@ -147,6 +183,8 @@ void load_rom(char const *filename, bool print_info) {
         // Original iNES assumes all carts have 8 KB of PRG RAM. For MMC5,
         // assume the cart has 64 KB.
         prg_ram_8k_banks = (mapper == 5) ? 8 : 1;
+        if (db_entry && db_entry->prg_ram_8k_banks != -1)
+            prg_ram_8k_banks = db_entry->prg_ram_8k_banks;
 
         fail_if(!(prg_ram_base = alloc_array_init<uint8_t>(0x2000*prg_ram_8k_banks, 0xFF)),
                 "failed to allocate %u KB of PRG RAM", 8*prg_ram_8k_banks);
@@ -157,19 +195,27 @@ void load_rom(char const *filename, bool print_info) {
     fail_if(!ciram,
             "failed to allocate %u bytes of nametable memory",
             mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    // Sets up the nametable pages for the initial mirroring. Mappers may
+    // change it later.
+    set_mirroring(mirroring);
 
     if ((uses_chr_ram = (chr_8k_banks == 0))) {
-        // Cart uses 8 KB of CHR RAM. Not sure about the initialization value
-        // here.
-        chr_8k_banks = 1;
-        fail_if(!(chr_base = alloc_array_init<uint8_t>(0x2000, 0xFF)),
-                "failed to allocate 8 KB of CHR RAM");
+        // Cart uses 8 KB of CHR RAM unless the database says otherwise. Not
+        // sure about the initialization value here.
+        chr_8k_banks = (db_entry && db_entry->chr_ram_8k_banks != -1) ?
+                         db_entry->chr_ram_8k_banks : 1;
+        fail_if(!(chr_base = alloc_array_init<uint8_t>(0x2000*chr_8k_banks, 0xFF)),
+                "failed to allocate %u KB of CHR RAM", 8*chr_8k_banks);
     }
     else chr_base = prg_base + 16*1024*prg_16k_banks;
 
+    // Decoded in init_ppu_for_rom()
+    fail_if(!(decoded_chr = alloc_array_init<uint64_t>(0x2000*chr_8k_banks, 0)),
+            "failed to allocate %u KB for decoded CHR", 64*chr_8k_banks);
+
     #undef PRINT_INFO
 
-    if (in_ines_2_0_format) {
+    if (header.in_ines_2_0_format) {
         fail("iNES 2.0 not yet supported");
         // http://wiki.nesdev.com/w/index.php/INES says byte 8 is the PRG RAM
         // size, http://wiki.nesdev.com/w/index.php/NES_2.0 that it contains
@@ -180,10 +226,13 @@ void load_rom(char const *filename, bool print_info) {
 
     fail_if(!mapper_functions[mapper].init, "mapper %u not supported\n", mapper);
 
+    // Mappers with separate sprite CHR pages (MMC5) change this
+    sprite_chr_pages = chr_pages;
     mapper_functions[mapper].init();
     read_mapper       = mapper_functions[mapper].read;
     write_mapper      = mapper_functions[mapper].write;
-    ppu_tick_callback = mapper_functions[mapper].ppu_tick_callback;
+    mapper_ppu_events = mapper_functions[mapper].ppu_events;
+    mapper_ppu_event  = mapper_functions[mapper].ppu_event;
     mapper_read_nt    = mapper_functions[mapper].read_nt;
     mapper_write_nt   = mapper_functions[mapper].write_nt;
     mapper_state_size = mapper_functions[mapper].state_size;
@@ -194,6 +243,7 @@ void load_rom(char const *filename, bool print_info) {
     // of the other initialization functions
     init_timing_for_rom();
 
+    init_cpu_for_rom();
     init_apu_for_rom();
     init_audio_for_rom();
     init_ppu_for_rom();
@@ -208,10 +258,11 @@ void unload_rom() {
     // Flush any pending audio samples
     end_audio_frame();
 
-    free_array_set_null(rom_buf);
+    unmap_file(rom_buf, rom_buf_size);
     free_array_set_null(ciram);
     if (uses_chr_ram)
         free_array_set_null(chr_base);
+    free_array_set_null(decoded_chr);
     free_array_set_null(prg_ram_base);
 
     deinit_audio_for_rom();
@@ -221,48 +272,35 @@ void unload_rom() {
 #endif
 }
 
-// ROM detection from a PRG MD5 digest. Needed to infer and correct information
-// for some ROMs.
+// ROM detection from a hash of the PRG and CHR ROM. Needed to infer and
+// correct information for some ROMs. See rom_db.h.
 
-static void correct_mirroring(Mirroring m) {
-    if (mirroring != m) {
-        printf("Correcting mirroring from %s to %s based on ROM checksum\n",
-               mirroring_to_str[mirroring], mirroring_to_str[m]);
-        mirroring = m;
-    }
-}
-
-static void enable_bus_conflicts() {
-    puts("Enabling bus conflicts based on ROM checksum");
-    has_bus_conflicts = true;
-}
-
-static void set_pal() {
-    puts("Setting PAL mode based on ROM checksum");
-    is_pal = true;
-}
+static void do_rom_specific_overrides(uint64_t hash) {
+    db_entry = lookup_rom_db(hash, prg_base, 0x4000*prg_16k_banks);
+    if (!db_entry)
+        return;
 
-static void do_rom_specific_overrides() {
-    static MD5_CTX md5_ctx;
-    static unsigned char md5[16];
+    if (db_entry->mapper != -1 && (unsigned)db_entry->mapper != mapper) {
+        printf("Correcting mapper from %u to %d based on ROM database\n",
+               mapper, db_entry->mapper);
+        mapper = db_entry->mapper;
+    }
 
-    MD5_Init(&md5_ctx);
-    MD5_Update(&md5_ctx, (void*)prg_base, 16*1024*prg_16k_banks);
-    MD5_Final(md5, &md5_ctx);
+    if (db_entry->mirroring != -1 && (Mirroring)db_entry->mirroring != mirroring) {
+        printf("Correcting mirroring from %s to %s based on ROM database\n",
+               mirroring_to_str[mirroring], mirroring_to_str[db_entry->mirroring]);
+        mirroring = (Mirroring)db_entry->mirroring;
+    }
 
-#if 0
-    for (unsigned i = 0; i < 16; ++i)
-        printf("%02X", md5[i]);
-    putchar('\n');
-#endif
+    if (db_entry->is_pal != -1 && db_entry->is_pal != is_pal) {
+        printf("Setting %s mode based on ROM database\n",
+               db_entry->is_pal ? "PAL" : "NTSC");
+        is_pal = db_entry->is_pal;
+    }
 
-    if (!memcmp(md5, "\xAC\x5F\x53\x53\x59\x87\x58\x45\xBC\xBD\x1B\x6F\x31\x30\x7D\xEC", 16))
-        // Cybernoid
-        enable_bus_conflicts();
-    else if (!memcmp(md5, "\x60\xC6\x21\xF5\xB5\x09\xD4\x14\xBB\x4A\xFB\x9B\x56\x95\xC0\x73", 16))
-        // High hopes
-        set_pal();
-    else if (!memcmp(md5, "\x44\x6F\xCD\x30\x75\x61\x00\xA9\x94\x35\x9A\xD4\xC5\xF8\x76\x67", 16))
-        // Rad Racer 2
-        correct_mirroring(FOUR_SCREEN);
+    if (db_entry->has_bus_conflicts != -1) {
+        printf("%s bus conflicts based on ROM database\n",
+               db_entry->has_bus_conflicts ? "Enabling" : "Disabling");
+        has_bus_conflicts = db_entry->has_bus_conflicts;
+    }
 }
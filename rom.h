@@ -12,5 +12,30 @@ extern bool     is_pal;
 
 extern bool     has_bus_conflicts;
 
+// Information from the 16-byte iNES header, before any ROM database overrides
+struct Ines_header {
+    unsigned prg_16k_banks;
+    unsigned chr_8k_banks;
+    unsigned mapper;
+    int      mirroring; // A Mirroring value
+    bool     has_battery;
+    bool     has_trainer;
+    bool     is_vs_unisystem;
+    bool     is_playchoice_10;
+    bool     in_ines_2_0_format;
+    // Bytes 12-15 not all zero in a non-iNES 2.0 header, which means junk
+    // (e.g. "DiskDude!") in bytes 7-15. Byte 7 is ignored.
+    bool     is_corrupted;
+};
+
+// Parses the header at 'buf', which must hold at least 16 bytes starting with
+// "NES\x1A". Does no validation.
+void parse_ines_header(uint8_t const *buf, Ines_header &header);
+// Returns the file size needed to hold the header, trainer, PRG ROM, and CHR
+// ROM
+size_t ines_min_size(Ines_header const &header);
+// Guesses the region from naming conventions like "(E)"
+bool filename_suggests_pal(char const *filename);
+
 void load_rom(char const *filename, bool print_info);
 void unload_rom();
@@ -0,0 +1,305 @@
+#include "common.h"
+
+#include "mapper.h"
+#include "md5.h"
+#include "rom_db.h"
+
+// Open-addressing hash table with linear probing, keyed on rom_hash(). Sized
+// to a power of two at least twice the number of lines in the database file,
+// so probe sequences stay short even for the full NES library.
+
+struct Hash_slot {
+    uint64_t     hash;
+    bool         used;
+    Rom_db_entry entry;
+};
+
+static Hash_slot *hash_slots;
+static size_t     hash_mask;
+
+// Legacy entries keyed on the MD5 digest of the PRG ROM. Few enough that a
+// linear search is fine.
+
+struct MD5_entry {
+    unsigned char md5[16];
+    Rom_db_entry  entry;
+};
+
+static MD5_entry *md5_entries;
+static unsigned   n_md5_entries;
+
+//
+// Hashing (XXH64 - https://github.com/Cyan4973/xxHash)
+//
+
+static uint64_t const prime_1 = UINT64_C(11400714785074694791);
+static uint64_t const prime_2 = UINT64_C(14029467366897019727);
+static uint64_t const prime_3 = UINT64_C(1609587929392839161);
+static uint64_t const prime_4 = UINT64_C(9650029242287828579);
+static uint64_t const prime_5 = UINT64_C(2870177450012600261);
+
+static uint64_t rotl(uint64_t n, unsigned shift) {
+    return (n << shift) | (n >> (64 - shift));
+}
+
+// Assumes a little-endian host, like the save state code
+static uint64_t read_64(uint8_t const *p) {
+    uint64_t res;
+    memcpy(&res, p, sizeof res);
+    return res;
+}
+
+static uint32_t read_32(uint8_t const *p) {
+    uint32_t res;
+    memcpy(&res, p, sizeof res);
+    return res;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    return rotl(acc + input*prime_2, 31)*prime_1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+    return (acc ^ hash_round(0, val))*prime_1 + prime_4;
+}
+
+uint64_t rom_hash(uint8_t const *data, size_t len) {
+    uint8_t const *p = data;
+    uint8_t const *const end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        // Four independent lanes keep the multiplier busy
+        uint64_t v1 = prime_1 + prime_2, v2 = prime_2, v3 = 0, v4 = -prime_1;
+        do {
+            v1 = hash_round(v1, read_64(p     ));
+            v2 = hash_round(v2, read_64(p +  8));
+            v3 = hash_round(v3, read_64(p + 16));
+            v4 = hash_round(v4, read_64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    }
+    else
+        h = prime_5;
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ hash_round(0, read_64(p)), 27)*prime_1 + prime_4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ read_32(p)*prime_1, 23)*prime_2 + prime_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ *p*prime_5, 11)*prime_1;
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= prime_2;
+    h ^= h >> 29;
+    h *= prime_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+//
+// Lookup
+//
+
+static Hash_slot *find_slot(uint64_t hash) {
+    // hash_slots is never full, so this terminates
+    for (size_t i = hash & hash_mask; ; i = (i + 1) & hash_mask)
+        if (!hash_slots[i].used || hash_slots[i].hash == hash)
+            return &hash_slots[i];
+}
+
+Rom_db_entry const *lookup_rom_db(uint64_t hash, uint8_t const *prg, size_t prg_len) {
+    if (hash_slots) {
+        Hash_slot const *const slot = find_slot(hash);
+        if (slot->used)
+            return &slot->entry;
+    }
+
+    if (prg && n_md5_entries > 0) {
+        MD5_CTX md5_ctx;
+        unsigned char md5[16];
+
+        MD5_Init(&md5_ctx);
+        MD5_Update(&md5_ctx, (void*)prg, prg_len);
+        MD5_Final(md5, &md5_ctx);
+
+        for (unsigned i = 0; i < n_md5_entries; ++i)
+            if (!memcmp(md5, md5_entries[i].md5, 16))
+                return &md5_entries[i].entry;
+    }
+
+    return 0;
+}
+
+//
+// Loading
+//
+
+static char const *db_filename;
+static unsigned    line_nr;
+
+static void parse_fail(char const *msg, char const *s) {
+    fail("%s:%u: %s: '%s'", db_filename, line_nr, msg, s);
+}
+
+// Parses the 'n_digits'-digit hex string 's' into bytes, most significant
+// first
+static void parse_hex(char const *s, unsigned n_digits, unsigned char *res) {
+    if (strlen(s) != n_digits || strspn(s, "0123456789abcdefABCDEF") != n_digits)
+        fail("%s:%u: expected a %u-digit hex hash: '%s'",
+             db_filename, line_nr, n_digits, s);
+    for (unsigned i = 0; i < n_digits/2; ++i) {
+        unsigned byte;
+        sscanf(s + 2*i, "%2x", &byte);
+        res[i] = byte;
+    }
+}
+
+static int parse_ram_8k_banks(char const *val) {
+    char *end;
+    long const kb = strtol(val, &end, 10);
+    // The mappers mask bank numbers, so the size must be a power of two
+    if (*val == '\0' || *end != '\0' || kb < 8 || kb > 1024 || kb % 8 != 0 ||
+        !is_pow_2_or_0(kb/8))
+        parse_fail("RAM size must be 8 KB times a power of two", val);
+    return kb/8;
+}
+
+static void parse_setting(char *setting, Rom_db_entry &entry) {
+    char *const eq = strchr(setting, '=');
+    char const *val = "";
+    if (eq) {
+        *eq = '\0';
+        val = eq + 1;
+    }
+
+    if (!strcmp(setting, "mapper")) {
+        char *end;
+        long const n = strtol(val, &end, 10);
+        if (*val == '\0' || *end != '\0' || n < 0 || n > 255)
+            parse_fail("bad mapper number", val);
+        entry.mapper = n;
+    }
+    else if (!strcmp(setting, "mirroring")) {
+        if      (!strcmp(val, "horizontal"))  entry.mirroring = HORIZONTAL;
+        else if (!strcmp(val, "vertical"))    entry.mirroring = VERTICAL;
+        else if (!strcmp(val, "four-screen")) entry.mirroring = FOUR_SCREEN;
+        else parse_fail("unknown mirroring", val);
+    }
+    else if (!strcmp(setting, "pal"))              entry.is_pal = 1;
+    else if (!strcmp(setting, "ntsc"))             entry.is_pal = 0;
+    else if (!strcmp(setting, "bus-conflicts"))    entry.has_bus_conflicts = 1;
+    else if (!strcmp(setting, "no-bus-conflicts")) entry.has_bus_conflicts = 0;
+    else if (!strcmp(setting, "prg-ram"))
+        entry.prg_ram_8k_banks = parse_ram_8k_banks(val);
+    else if (!strcmp(setting, "chr-ram"))
+        entry.chr_ram_8k_banks = parse_ram_8k_banks(val);
+    else
+        parse_fail("unknown setting", setting);
+}
+
+static void parse_line(char *line) {
+    // Strip comment
+    char *const comment = strchr(line, '#');
+    if (comment)
+        *comment = '\0';
+
+    char *save_ptr;
+    char *const key = strtok_r(line, " \t\r", &save_ptr);
+    if (!key)
+        // Blank line
+        return;
+
+    Rom_db_entry entry;
+    entry.mapper = entry.mirroring = entry.is_pal = entry.has_bus_conflicts =
+      entry.prg_ram_8k_banks = entry.chr_ram_8k_banks = -1;
+    for (char *setting; (setting = strtok_r(0, " \t\r", &save_ptr)); )
+        parse_setting(setting, entry);
+
+    if (!strncmp(key, "md5:", 4)) {
+        MD5_entry &md5_entry = md5_entries[n_md5_entries++];
+        parse_hex(key + 4, 32, md5_entry.md5);
+        md5_entry.entry = entry;
+        return;
+    }
+
+    unsigned char hash_bytes[8];
+    parse_hex(key, 16, hash_bytes);
+    uint64_t hash = 0;
+    for (unsigned i = 0; i < 8; ++i)
+        hash = (hash << 8) | hash_bytes[i];
+
+    Hash_slot *const slot = find_slot(hash);
+    if (slot->used)
+        parse_fail("duplicate entry", key);
+    slot->hash  = hash;
+    slot->used  = true;
+    slot->entry = entry;
+}
+
+void load_rom_db(char const *filename) {
+    if (access(filename, F_OK) == -1)
+        return;
+
+    size_t size;
+    uint8_t *file = map_file(filename, size);
+    char const *const text = (char const*)file;
+
+    // Upper bound on the number of entries, used to size the tables
+    size_t n_lines = 1;
+    for (size_t i = 0; i < size; ++i)
+        if (text[i] == '\n')
+            ++n_lines;
+
+    size_t n_slots = 2;
+    while (n_slots < 2*n_lines)
+        n_slots *= 2;
+    hash_mask = n_slots - 1;
+
+    fail_if(!(hash_slots = new (std::nothrow) Hash_slot[n_slots]()),
+            "failed to allocate %zu-entry hash table for ROM database", n_slots);
+    fail_if(!(md5_entries = new (std::nothrow) MD5_entry[n_lines]),
+            "failed to allocate MD5 entries for ROM database");
+    n_md5_entries = 0;
+
+    db_filename = filename;
+    line_nr = 0;
+    char line[256];
+    for (size_t start = 0; start < size; ) {
+        ++line_nr;
+
+        size_t end = start;
+        while (end < size && text[end] != '\n')
+            ++end;
+        size_t const len = end - start;
+        fail_if(len >= sizeof line, "%s:%u: line too long", filename, line_nr);
+
+        memcpy(line, text + start, len);
+        line[len] = '\0';
+        parse_line(line);
+
+        start = end + 1;
+    }
+
+    unmap_file(file, size);
+}
+
+void unload_rom_db() {
+    free_array_set_null(hash_slots);
+    hash_slots = 0;
+    free_array_set_null(md5_entries);
+    md5_entries = 0;
+    n_md5_entries = 0;
+}
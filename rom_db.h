@@ -0,0 +1,45 @@
+// ROM override database. Corrects header information (mapper, mirroring,
+// region, bus conflicts, RAM sizes) for ROMs with bad or incomplete iNES
+// headers.
+//
+// The database is a text file with one ROM per line:
+//
+//   <key> [<setting>...]  # Optional comment
+//
+// <key> is either the 16-hex-digit rom_hash() of the PRG ROM followed by the
+// CHR ROM (printed by load_rom()), or "md5:" followed by the 32-hex-digit MD5
+// digest of the PRG ROM alone. MD5 keys are for entries added before the
+// switch to rom_hash(), and the MD5 digest is only computed if the database
+// contains MD5 keys and the hash lookup misses. <setting> is one of
+//
+//   mapper=<n>
+//   mirroring=horizontal|vertical|four-screen
+//   pal, ntsc
+//   bus-conflicts, no-bus-conflicts
+//   prg-ram=<n>  (KB, 8 times a power of two)
+//   chr-ram=<n>  (KB, 8 times a power of two - only used without CHR ROM)
+
+// Fields are -1 when not overridden
+struct Rom_db_entry {
+    int mapper;
+    int mirroring; // A Mirroring value
+    int is_pal;
+    int has_bus_conflicts;
+    int prg_ram_8k_banks;
+    int chr_ram_8k_banks;
+};
+
+// Loads the database from 'filename'. A missing file is not an error.
+void load_rom_db(char const *filename);
+void unload_rom_db();
+
+// Returns the entry for the ROM whose PRG ROM starts at 'prg' and is
+// immediately followed by its CHR ROM, or null if the ROM isn't in the
+// database. 'hash' is rom_hash(prg, prg_len + chr_len). 'prg' may be null, in
+// which case legacy MD5 entries are not searched.
+Rom_db_entry const *lookup_rom_db(uint64_t hash, uint8_t const *prg, size_t prg_len);
+
+// Fast non-cryptographic hash used as the database key (XXH64 with seed 0).
+// Several times faster than MD5, which matters for large ROMs and for
+// indexing many ROMs.
+uint64_t rom_hash(uint8_t const *data, size_t len);
@@ -0,0 +1,408 @@
+#include "common.h"
+
+#include "rom.h"
+#include "rom_db.h"
+#include "rom_index.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <SDL.h>
+
+// Everything needed to select a ROM without opening it. Only holds
+// information derived from the file itself - ROM database overrides are
+// applied when printing, so that database changes don't invalidate the cache.
+
+enum Index_flags {
+    // Set if the file is a usable iNES ROM. Other files are cached too, so that
+    // they aren't re-read on each run.
+    INDEX_VALID       = 1 << 0,
+    INDEX_PAL         = 1 << 1, // From the filename
+    INDEX_BATTERY     = 1 << 2,
+    INDEX_TRAINER     = 1 << 3,
+    INDEX_VS          = 1 << 4,
+    INDEX_PLAYCHOICE  = 1 << 5,
+    INDEX_INES_2_0    = 1 << 6
+};
+
+struct Index_entry {
+    // Relative to the indexed directory
+    char    *path;
+    // Cache key together with 'path'
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint64_t size;
+
+    uint64_t hash;
+    uint16_t mapper;
+    uint8_t  prg_16k_banks;
+    uint8_t  chr_8k_banks;
+    uint8_t  mirroring;
+    uint8_t  flags;
+};
+
+// Bump when the format of Index_entry or the way it is computed changes
+static char const     cache_magic[8] = "NESIDX";
+static uint32_t const cache_version  = 1;
+static char const     cache_name[]   = ".nesalizer-index";
+
+//
+// Growable entry arrays
+//
+
+struct Entry_array {
+    Index_entry *entries;
+    size_t       len, cap;
+};
+
+static Index_entry &append_entry(Entry_array &arr) {
+    if (arr.len == arr.cap) {
+        size_t const new_cap = arr.cap ? 2*arr.cap : 256;
+        Index_entry *new_entries;
+        fail_if(!(new_entries = new (std::nothrow) Index_entry[new_cap]),
+                "failed to allocate %zu-entry ROM index", new_cap);
+        if (arr.len > 0)
+            memcpy(new_entries, arr.entries, arr.len*sizeof(Index_entry));
+        free_array_set_null(arr.entries);
+        arr.entries = new_entries;
+        arr.cap = new_cap;
+    }
+    return arr.entries[arr.len++];
+}
+
+static void free_entries(Entry_array &arr) {
+    for (size_t i = 0; i < arr.len; ++i)
+        free_array_set_null(arr.entries[i].path);
+    free_array_set_null(arr.entries);
+    arr.entries = 0;
+    arr.len = arr.cap = 0;
+}
+
+static char *copy_string(char const *s, size_t len) {
+    char *res;
+    fail_if(!(res = new (std::nothrow) char[len + 1]),
+            "failed to allocate %zu bytes for path", len + 1);
+    memcpy(res, s, len);
+    res[len] = '\0';
+    return res;
+}
+
+static int compare_entry_paths(void const *a, void const *b) {
+    return strcmp(((Index_entry const*)a)->path, ((Index_entry const*)b)->path);
+}
+
+//
+// Cache file
+//
+// The header is cache_magic, cache_version, and the number of entries. Each
+// entry is the fields of Index_entry with the path replaced by its length,
+// followed by the path. Entries are sorted by path.
+//
+
+template<bool calculating_size, bool is_save>
+static size_t transfer_entry(Index_entry &e, uint16_t &path_len, uint8_t *&buf) {
+    uint8_t *tmp = buf;
+    #define T(x) transfer<calculating_size, is_save>(x, buf);
+    T(e.mtime_sec) T(e.mtime_nsec) T(e.size) T(e.hash) T(e.mapper)
+    T(e.prg_16k_banks) T(e.chr_8k_banks) T(e.mirroring) T(e.flags) T(path_len)
+    #undef T
+    return buf - tmp;
+}
+
+static size_t entry_size() {
+    Index_entry e;
+    uint16_t path_len;
+    uint8_t *buf = 0;
+    return transfer_entry<true, false>(e, path_len, buf);
+}
+
+// Returns the old entries sorted by path, or an empty array if the cache is
+// missing or unusable
+static void load_cache(char const *cache_path, Entry_array &old) {
+    old.entries = 0;
+    old.len = old.cap = 0;
+
+    if (access(cache_path, F_OK) == -1)
+        return;
+
+    size_t size;
+    uint8_t *file = map_file(cache_path, size);
+    uint8_t *buf = file;
+    uint8_t *const end = file + size;
+
+    uint32_t version, n_entries;
+    size_t const header_size = sizeof cache_magic + sizeof version + sizeof n_entries;
+    if (size < header_size || memcmp(buf, cache_magic, sizeof cache_magic))
+        goto unusable;
+    buf += sizeof cache_magic;
+    transfer<false, false>(version, buf);
+    transfer<false, false>(n_entries, buf);
+    if (version != cache_version)
+        goto unusable;
+
+    for (uint32_t i = 0; i < n_entries; ++i) {
+        if ((size_t)(end - buf) < entry_size())
+            goto unusable;
+        Index_entry e;
+        uint16_t path_len;
+        transfer_entry<false, false>(e, path_len, buf);
+        if ((size_t)(end - buf) < path_len)
+            goto unusable;
+        e.path = copy_string((char const*)buf, path_len);
+        buf += path_len;
+        append_entry(old) = e;
+    }
+
+    unmap_file(file, size);
+    return;
+
+unusable:
+    fprintf(stderr, "Ignoring unusable ROM index cache '%s'\n", cache_path);
+    unmap_file(file, size);
+    free_entries(old);
+}
+
+static void save_cache(char const *cache_path, Entry_array const &arr) {
+    char tmp_path[PATH_MAX];
+    fail_if((size_t)snprintf(tmp_path, sizeof tmp_path, "%s.tmp", cache_path) >= sizeof tmp_path,
+            "path '%s.tmp' is too long", cache_path);
+
+    FILE *file;
+    errno_fail_if(!(file = fopen(tmp_path, "wb")), "failed to open '%s'", tmp_path);
+
+    uint8_t header[sizeof cache_magic + 2*sizeof(uint32_t)];
+    uint8_t *buf = header;
+    uint32_t version = cache_version, n_entries = arr.len;
+    memcpy(buf, cache_magic, sizeof cache_magic);
+    buf += sizeof cache_magic;
+    transfer<false, true>(version, buf);
+    transfer<false, true>(n_entries, buf);
+    errno_fail_if(fwrite(header, sizeof header, 1, file) != 1,
+                  "failed to write '%s'", tmp_path);
+
+    uint8_t *const entry_buf = new (std::nothrow) uint8_t[entry_size()];
+    fail_if(!entry_buf, "failed to allocate ROM index entry buffer");
+    for (size_t i = 0; i < arr.len; ++i) {
+        uint16_t path_len = strlen(arr.entries[i].path);
+        buf = entry_buf;
+        transfer_entry<false, true>(arr.entries[i], path_len, buf);
+        errno_fail_if(fwrite(entry_buf, entry_size(), 1, file) != 1 ||
+                      fwrite(arr.entries[i].path, path_len, 1, file) != 1,
+                      "failed to write '%s'", tmp_path);
+    }
+    free_array_set_null(entry_buf);
+
+    errno_fail_if(fclose(file) == EOF, "failed to close '%s'", tmp_path);
+    // Atomically replace the old cache, so that an interrupted run never
+    // leaves a truncated one behind
+    errno_fail_if(rename(tmp_path, cache_path) == -1,
+                  "failed to rename '%s' to '%s'", tmp_path, cache_path);
+}
+
+//
+// Directory scanning
+//
+
+static bool has_nes_extension(char const *name) {
+    size_t const len = strlen(name);
+    return len > 4 && !strcasecmp(name + len - 4, ".nes");
+}
+
+// Appends an entry with the path, size, and modification time of each .nes
+// file in 'dir'/'rel_dir'. The remaining fields are filled in later.
+static void scan_dir(char const *dir, char const *rel_dir, Entry_array &arr) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, rel_dir);
+
+    DIR *d;
+    if (!(d = opendir(path))) {
+        fprintf(stderr, "Skipping '%s': %s\n", path, strerror(errno));
+        return;
+    }
+
+    for (dirent *ent; (ent = readdir(d)); ) {
+        // Skips '.', '..', hidden files, and the cache
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char rel_path[PATH_MAX];
+        if ((size_t)snprintf(rel_path, sizeof rel_path, "%s%s%s", rel_dir,
+                             *rel_dir ? "/" : "", ent->d_name) >= sizeof rel_path ||
+            (size_t)snprintf(path, sizeof path, "%s/%s", dir, rel_path) >= sizeof path) {
+            fprintf(stderr, "Skipping '%s': path too long\n", ent->d_name);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(path, &st) == -1) {
+            fprintf(stderr, "Skipping '%s': %s\n", path, strerror(errno));
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+            scan_dir(dir, rel_path, arr);
+        else if (S_ISREG(st.st_mode) && has_nes_extension(ent->d_name)) {
+            // map_file() fails hard, so weed out unreadable files here
+            if (access(path, R_OK) == -1) {
+                fprintf(stderr, "Skipping '%s': %s\n", path, strerror(errno));
+                continue;
+            }
+            Index_entry &e = append_entry(arr);
+            e.path       = copy_string(rel_path, strlen(rel_path));
+            e.mtime_sec  = st.st_mtim.tv_sec;
+            e.mtime_nsec = st.st_mtim.tv_nsec;
+            e.size       = st.st_size;
+        }
+    }
+
+    closedir(d);
+}
+
+//
+// Indexing
+//
+
+static char const *index_dir;
+
+// Work queue shared by the indexing threads. Entries are independent, so a
+// counter is all the coordination needed.
+static Index_entry **jobs;
+static size_t        n_jobs;
+static size_t        next_job;
+
+static void index_file(Index_entry &e) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", index_dir, e.path);
+
+    e.flags = filename_suggests_pal(e.path) ? INDEX_PAL : 0;
+    e.hash = e.mapper = e.prg_16k_banks = e.chr_8k_banks = e.mirroring = 0;
+
+    size_t size;
+    uint8_t *rom = map_file(path, size);
+
+    // Same checks as load_rom()
+    if (size >= 16 && !memcmp(rom, "NES\x1A", 4)) {
+        Ines_header header;
+        parse_ines_header(rom, header);
+        if (header.prg_16k_banks != 0 &&
+            is_pow_2_or_0(header.prg_16k_banks) && is_pow_2_or_0(header.chr_8k_banks) &&
+            size >= ines_min_size(header)) {
+
+            uint8_t const *const prg = rom + 16 + 512*header.has_trainer;
+            e.hash          = rom_hash(prg, 0x4000*header.prg_16k_banks +
+                                            0x2000*header.chr_8k_banks);
+            e.mapper        = header.mapper;
+            e.prg_16k_banks = header.prg_16k_banks;
+            e.chr_8k_banks  = header.chr_8k_banks;
+            e.mirroring     = header.mirroring;
+            e.flags |= INDEX_VALID |
+                       (header.has_battery        ? INDEX_BATTERY    : 0) |
+                       (header.has_trainer        ? INDEX_TRAINER    : 0) |
+                       (header.is_vs_unisystem    ? INDEX_VS         : 0) |
+                       (header.is_playchoice_10   ? INDEX_PLAYCHOICE : 0) |
+                       (header.in_ines_2_0_format ? INDEX_INES_2_0   : 0);
+        }
+    }
+
+    unmap_file(rom, size);
+}
+
+static int index_thread(void*) {
+    for (;;) {
+        size_t const job = __sync_fetch_and_add(&next_job, 1);
+        if (job >= n_jobs)
+            return 0;
+        index_file(*jobs[job]);
+    }
+}
+
+static void print_entry(Index_entry const &e) {
+    if (!(e.flags & INDEX_VALID))
+        return;
+
+    static char const *const mirroring_names[] =
+      { "horizontal", "vertical", "one-screen-low", "one-screen-high", "four-screen" };
+
+    unsigned mapper    = e.mapper;
+    unsigned mirroring = e.mirroring;
+    bool     is_pal    = e.flags & INDEX_PAL;
+
+    // Legacy MD5 database entries need the PRG ROM and are skipped, to avoid
+    // opening the file
+    Rom_db_entry const *const db = lookup_rom_db(e.hash, 0, 0);
+    if (db) {
+        if (db->mapper    != -1) mapper    = db->mapper;
+        if (db->mirroring != -1) mirroring = db->mirroring;
+        if (db->is_pal    != -1) is_pal    = db->is_pal;
+    }
+
+    printf("%016" PRIx64 "\t%u\t%s\t%s\t%u\t%u\t%s\n",
+           e.hash, mapper, is_pal ? "PAL" : "NTSC", mirroring_names[mirroring],
+           16*e.prg_16k_banks, 8*e.chr_8k_banks, e.path);
+}
+
+void index_roms(char const *dir) {
+    index_dir = dir;
+
+    char cache_path[PATH_MAX];
+    fail_if((size_t)snprintf(cache_path, sizeof cache_path, "%s/%s", dir, cache_name) >= sizeof cache_path,
+            "path '%s' is too long", dir);
+
+    Entry_array old;
+    load_cache(cache_path, old);
+
+    Entry_array cur = { 0, 0, 0 };
+    scan_dir(dir, "", cur);
+    qsort(cur.entries, cur.len, sizeof(Index_entry), compare_entry_paths);
+
+    // Reuse cached results for files whose size and modification time are
+    // unchanged, and queue the rest
+
+    fail_if(!(jobs = new (std::nothrow) Index_entry*[cur.len + 1]),
+            "failed to allocate ROM index work queue");
+    n_jobs = next_job = 0;
+
+    for (size_t i = 0; i < cur.len; ++i) {
+        Index_entry &e = cur.entries[i];
+        Index_entry const *const cached = old.len == 0 ? 0 :
+          (Index_entry const*)bsearch(&e, old.entries, old.len, sizeof(Index_entry),
+                                      compare_entry_paths);
+        if (cached && cached->size == e.size &&
+            cached->mtime_sec == e.mtime_sec && cached->mtime_nsec == e.mtime_nsec) {
+            char *const path = e.path;
+            e = *cached;
+            e.path = path;
+        }
+        else
+            jobs[n_jobs++] = &e;
+    }
+
+    // Index the changed files on all cores
+
+    if (n_jobs > 0) {
+        unsigned const n_threads = min(n_jobs, (size_t)max(SDL_GetCPUCount(), 1));
+        SDL_Thread **threads;
+        fail_if(!(threads = new (std::nothrow) SDL_Thread*[n_threads]),
+                "failed to allocate ROM indexing threads");
+        for (unsigned i = 0; i < n_threads; ++i)
+            fail_if(!(threads[i] = SDL_CreateThread(index_thread, "indexing", 0)),
+                    "failed to create ROM indexing thread: %s", SDL_GetError());
+        for (unsigned i = 0; i < n_threads; ++i)
+            SDL_WaitThread(threads[i], 0);
+        free_array_set_null(threads);
+    }
+
+    if (n_jobs > 0 || cur.len != old.len)
+        // Something was added, changed, or removed
+        save_cache(cache_path, cur);
+
+    for (size_t i = 0; i < cur.len; ++i)
+        print_entry(cur.entries[i]);
+
+    fprintf(stderr, "Indexed %zu .nes files in '%s' (%zu read, %zu cached)\n",
+            cur.len, dir, n_jobs, cur.len - n_jobs);
+
+    free_array_set_null(jobs);
+    jobs = 0;
+    free_entries(cur);
+    free_entries(old);
+}
@@ -0,0 +1,12 @@
+// ROM library indexing (--index)
+
+// Scans 'dir' recursively for .nes files, parses their headers and hashes them
+// using one thread per core, and prints one tab-separated line per ROM to
+// stdout:
+//
+//   <hash> <mapper> <NTSC|PAL> <mirroring> <PRG KB> <CHR KB> <path>
+//
+// ROM database overrides are applied to the printed values. Results are cached
+// in <dir>/.nesalizer-index, and only files whose size or modification time
+// changed since the last run are read again.
+void index_roms(char const *dir);
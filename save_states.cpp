@@ -7,7 +7,10 @@
 #include "input.h"
 #include "ppu.h"
 #include "mapper.h"
+#include "profile.h"
+#include "rom.h"
 #include "save_states.h"
+#include "sdl_backend.h"
 
 // Number of seconds of rewind to support. The rewind buffer is a ring buffer
 // where a new state will overwrite the oldest state when the buffer is full.
@@ -18,7 +21,9 @@ static size_t    state_size;
 static uint8_t  *state;
 
 unsigned const   n_rewind_frames = 60*n_rewind_seconds;
-static uint8_t  *rewind_buf;
+// Size of rewind snapshots, which leave out the tracked memory areas. See
+// push_state().
+static size_t    snapshot_size;
 static unsigned  rewind_buf_i;
 // frame_len[n] is the length of frame n in CPU ticks. Used to cleanly reverse
 // audio.
@@ -26,15 +31,258 @@ static unsigned *frame_len;
 static unsigned  n_recorded_frames;
 bool             is_backwards_frame;
 
+// See the timeline section
+unsigned         timeline_frame;
+
+//
+// Dirty page tracking
+//
+
+unsigned const   dirty_page_size = 1 << dirty_page_shift;
+
+size_t           tracked_mem_len[N_TRACKED_MEMS];
+uint8_t         *dirty_pages[N_TRACKED_MEMS];
+static uint8_t  *tracked_mem[N_TRACKED_MEMS];
+// Copy of each tracked area as of the most recent rewind snapshot. The live
+// memory only differs from it in dirty pages.
+static uint8_t  *tracked_base[N_TRACKED_MEMS];
+
+// Previous contents of a page dirtied between two rewind snapshots. Applying
+// the records of the top snapshot to tracked_base[] steps it back to the
+// snapshot below.
+struct Page_record {
+    Tracked_mem mem;
+    unsigned    page;
+    uint8_t     data[dirty_page_size];
+};
+
+// Ring buffer of page records. The records of each snapshot are contiguous,
+// and the records of newer snapshots come after those of older ones.
+static Page_record *page_records;
+static unsigned     n_page_records;
+// Index where the next record goes
+static unsigned     page_records_i;
+static unsigned     n_used_page_records;
+// first_page_record[n] and n_snapshot_records[n] give the records of rewind
+// snapshot n
+static unsigned    *first_page_record;
+static unsigned    *n_snapshot_records;
+
+static unsigned n_pages(unsigned mem) {
+    return tracked_mem_len[mem] >> dirty_page_shift;
+}
+
+static void mark_all_dirty() {
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        for (unsigned page = 0; page < n_pages(mem); ++page)
+            dirty_pages[mem][page] = DIRTY_ALL;
+}
+
+// Copies the dirty pages back from tracked_base[], undoing all writes since
+// the top snapshot
+static void restore_dirty_pages() {
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        for (unsigned page = 0; page < n_pages(mem); ++page)
+            if (dirty_pages[mem][page] & DIRTY_REWIND) {
+                size_t const offset = page << dirty_page_shift;
+                memcpy(tracked_mem[mem] + offset, tracked_base[mem] + offset,
+                       dirty_page_size);
+                if (mem == CHR_RAM_MEM)
+                    decode_chr(offset, dirty_page_size);
+                // Still dirty from the snapshot tree's point of view
+                dirty_pages[mem][page] = DIRTY_SNAPSHOT;
+            }
+}
+
 template<bool calculating_size, bool is_save>
+static void transfer_tracked_mem(uint8_t *&buf) {
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        if (tracked_mem_len[mem] > 0)
+            transfer_mem<calculating_size, is_save>
+              (tracked_mem[mem], tracked_mem_len[mem], buf);
+
+    if (!calculating_size && !is_save) {
+        if (uses_chr_ram)
+            decode_chr(0, tracked_mem_len[CHR_RAM_MEM]);
+        // tracked_base[] is stale now
+        mark_all_dirty();
+    }
+}
+
+//
+// Snapshot compression
+//
+
+// Rewind snapshots are stored as their XOR with the snapshot below them,
+// encoded as runs of a 16-bit count of unchanged bytes, a 16-bit count of
+// changed bytes, and the XORed changed bytes. (Timeline keyframes use the
+// same encoding.) As XOR is its own inverse, the
+// snapshot below can be recovered from the top one, which is all rewinding
+// needs.
+//
+// Compression happens on a separate thread. push_state() saves into a free
+// raw slot and hands it off, and rewinding waits for the compression thread
+// to catch up before touching the rewind buffer.
+
+// Raw snapshots waiting to be compressed, in push order
+unsigned const     n_raw_slots = 4;
+static uint8_t    *raw_slots[n_raw_slots];
+// Rewind buffer index of the snapshot in each slot
+static unsigned    raw_slot_frame[n_raw_slots];
+static unsigned    first_pending_slot;
+static unsigned    n_pending_slots;
+// The most recently compressed snapshot, uncompressed. Stepped back by
+// pop_state().
+static uint8_t    *top_raw;
+
+// Ring buffer of compressed snapshots. Organized like page_records.
+static uint8_t    *delta_buf;
+static size_t      delta_buf_size;
+static size_t      delta_buf_i;
+static size_t      n_used_delta_bytes;
+static size_t     *delta_start;
+static size_t     *delta_len;
+// Worst-case size of a compressed snapshot
+static size_t      max_snapshot_delta_len;
+
+static uint8_t    *encode_buf;
+static uint8_t    *decode_buf;
+
+// Totals for reporting the compression ratio
+static uint64_t    n_raw_bytes;
+static uint64_t    n_compressed_bytes;
+
+// Protects the raw slots, the ring buffer indices, and n_recorded_frames
+static SDL_mutex  *rewind_lock;
+// Signaled when a raw slot is handed off, and on exit
+static SDL_cond   *slot_pending_cond;
+// Signaled when the compression thread is done with a raw slot
+static SDL_cond   *slot_done_cond;
+static SDL_Thread *compression_thread;
+static bool        exit_compression_thread;
+
+// Worst-case size of the encoding of 'size' bytes. Runs are at least five
+// bytes apart, apart from the last one and runs split due to the 16-bit
+// counts.
+static size_t max_delta_len(size_t size) {
+    return size + 4*(size/5 + 2*(size/0xFFFF) + 2);
+}
+
+static size_t encode_delta(uint8_t const *cur, uint8_t const *prev, size_t size,
+                           uint8_t *out) {
+    uint8_t *const start = out;
+
+    for (size_t i = 0;;) {
+        size_t const skip_start = i;
+        while (i < size && cur[i] == prev[i] && i - skip_start < 0xFFFF)
+            ++i;
+        if (i == size)
+            break;
+
+        // End the run of changed bytes once at least four unchanged bytes
+        // follow, which is where starting a new run pays off
+        size_t const run_start = i;
+        while (i < size && i - run_start < 0xFFFF &&
+               !(i + 4 <= size && !memcmp(cur + i, prev + i, 4)))
+            ++i;
+
+        uint16_t const skip = run_start - skip_start, len = i - run_start;
+        memcpy(out, &skip, 2);
+        memcpy(out + 2, &len, 2);
+        out += 4;
+        for (size_t j = run_start; j < i; ++j)
+            *out++ = cur[j] ^ prev[j];
+    }
+
+    return out - start;
+}
+
+static void apply_delta(uint8_t *state, uint8_t const *delta, size_t len) {
+    uint8_t const *const end = delta + len;
+    for (uint8_t *p = state; delta < end;) {
+        uint16_t skip, run_len;
+        memcpy(&skip, delta, 2);
+        memcpy(&run_len, delta + 2, 2);
+        delta += 4;
+        p += skip;
+        for (unsigned i = 0; i < run_len; ++i)
+            *p++ ^= *delta++;
+    }
+}
+
+static void drop_oldest_state();
+
+// Appends the compressed snapshot in encode_buf to delta_buf. Called with
+// rewind_lock held.
+static void store_delta(unsigned frame, size_t len) {
+    // The ring buffer has room for many snapshots, so the oldest one is never
+    // still waiting to be compressed
+    while (delta_buf_size - n_used_delta_bytes < len)
+        drop_oldest_state();
+
+    delta_start[frame] = delta_buf_i;
+    delta_len[frame] = len;
+    size_t const first_part = min(len, delta_buf_size - delta_buf_i);
+    memcpy(delta_buf + delta_buf_i, encode_buf, first_part);
+    memcpy(delta_buf, encode_buf + first_part, len - first_part);
+    delta_buf_i = (delta_buf_i + len) % delta_buf_size;
+    n_used_delta_bytes += len;
+
+    n_raw_bytes += snapshot_size;
+    n_compressed_bytes += len;
+}
+
+static int compression_thread_fn(void*) {
+    SDL_LockMutex(rewind_lock);
+    for (;;) {
+        while (n_pending_slots == 0 && !exit_compression_thread)
+            SDL_CondWait(slot_pending_cond, rewind_lock);
+        if (n_pending_slots == 0)
+            break;
+
+        uint8_t *const raw = raw_slots[first_pending_slot];
+        SDL_UnlockMutex(rewind_lock);
+
+        size_t const len = encode_delta(raw, top_raw, snapshot_size, encode_buf);
+
+        SDL_LockMutex(rewind_lock);
+        store_delta(raw_slot_frame[first_pending_slot], len);
+        // The new snapshot becomes the top one, and the buffer of the old
+        // top snapshot gets reused as a slot
+        raw_slots[first_pending_slot] = top_raw;
+        top_raw = raw;
+        first_pending_slot = (first_pending_slot + 1) % n_raw_slots;
+        --n_pending_slots;
+        SDL_CondSignal(slot_done_cond);
+    }
+    SDL_UnlockMutex(rewind_lock);
+
+    return 0;
+}
+
+// Waits for the compression thread to finish all pending snapshots. After
+// this, the emulation thread can access the rewind buffer without locking.
+static void wait_for_compression() {
+    SDL_LockMutex(rewind_lock);
+    while (n_pending_slots > 0)
+        SDL_CondWait(slot_done_cond, rewind_lock);
+    SDL_UnlockMutex(rewind_lock);
+}
+
+template<bool calculating_size, bool is_save, bool is_snapshot>
 static size_t transfer_system_state(uint8_t *buf) {
     uint8_t *tmp = buf;
 
+    // Rewind snapshots handle the tracked memory separately
+    if (!is_snapshot)
+        transfer_tracked_mem<calculating_size, is_save>(buf);
+
     transfer_apu_state<calculating_size, is_save>(buf);
     transfer_cpu_state<calculating_size, is_save>(buf);
     transfer_ppu_state<calculating_size, is_save>(buf);
     transfer_controller_state<calculating_size, is_save>(buf);
     transfer_input_state<calculating_size, is_save>(buf);
+    transfer<calculating_size, is_save>(timeline_frame, buf);
 
     if (calculating_size)
         mapper_state_size(buf);
@@ -54,16 +302,25 @@ static size_t transfer_system_state(uint8_t *buf) {
 //
 
 void save_state() {
-    transfer_system_state<false, true>(state);
+    transfer_system_state<false, true, false>(state);
     has_save = true;
 }
 
+static void clear_rewind() {
+    wait_for_compression();
+    n_recorded_frames = 0;
+    page_records_i = n_used_page_records = 0;
+    delta_buf_i = n_used_delta_bytes = 0;
+}
+
+static void reset_timeline();
+
 void load_state() {
     if (has_save) {
-        // Clear rewind
-        n_recorded_frames = 0;
-
-        transfer_system_state<false, false>(state);
+        clear_rewind();
+        transfer_system_state<false, false, false>(state);
+        // The save state might not be from the current timeline
+        reset_timeline();
     }
 }
 
@@ -77,26 +334,113 @@ void save_audio_frame_length(unsigned len) {
     frame_len[rewind_buf_i] = len;
 }
 
+// Removes the oldest state from the rewind buffer to make room. Called with
+// rewind_lock held.
+static void drop_oldest_state() {
+    assert(n_recorded_frames > 0);
+    unsigned const oldest_i =
+      (rewind_buf_i + n_rewind_frames + 1 - n_recorded_frames) % n_rewind_frames;
+    n_used_page_records -= n_snapshot_records[oldest_i];
+    n_used_delta_bytes  -= delta_len[oldest_i];
+    --n_recorded_frames;
+}
+
 // Saves the current state to the rewind buffer. New states overwrite old if
 // the buffer becomes full.
+//
+// The tracked memory areas are saved incrementally: For each page dirtied
+// since the previous snapshot, the old contents from tracked_base[] go into a
+// page record, and tracked_base[] is brought up to date. The rest of the state
+// is compressed by the compression thread.
 static void push_state() {
-    if (n_recorded_frames < n_rewind_frames)
-        ++n_recorded_frames;
+    PROF_BEGIN(PROF_REWIND);
+
+    SDL_LockMutex(rewind_lock);
+    // Only waits if the compression thread falls behind
+    while (n_pending_slots == n_raw_slots)
+        SDL_CondWait(slot_done_cond, rewind_lock);
+    unsigned const slot = (first_pending_slot + n_pending_slots) % n_raw_slots;
+    SDL_UnlockMutex(rewind_lock);
+
+    transfer_system_state<false, true, true>(raw_slots[slot]);
 
+    SDL_LockMutex(rewind_lock);
+
+    if (n_recorded_frames == n_rewind_frames)
+        drop_oldest_state();
+    ++n_recorded_frames;
     rewind_buf_i = (rewind_buf_i + 1) % n_rewind_frames;
-    transfer_system_state<false, true>(rewind_buf + state_size*rewind_buf_i);
+    // Filled in by the compression thread
+    delta_len[rewind_buf_i] = 0;
+
+    first_page_record[rewind_buf_i] = page_records_i;
+    n_snapshot_records[rewind_buf_i] = 0;
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        for (unsigned page = 0; page < n_pages(mem); ++page)
+            if (dirty_pages[mem][page] & DIRTY_REWIND) {
+                // There's always room for a full set of pages for the new
+                // snapshot
+                while (n_used_page_records == n_page_records)
+                    drop_oldest_state();
+
+                size_t const offset = page << dirty_page_shift;
+                Page_record &record = page_records[page_records_i];
+                record.mem  = (Tracked_mem)mem;
+                record.page = page;
+                memcpy(record.data, tracked_base[mem] + offset, dirty_page_size);
+                memcpy(tracked_base[mem] + offset, tracked_mem[mem] + offset,
+                       dirty_page_size);
+                dirty_pages[mem][page] &= ~DIRTY_REWIND;
+
+                page_records_i = (page_records_i + 1) % n_page_records;
+                ++n_used_page_records;
+                ++n_snapshot_records[rewind_buf_i];
+            }
+
+    raw_slot_frame[slot] = rewind_buf_i;
+    ++n_pending_slots;
+    SDL_CondSignal(slot_pending_cond);
+
+    SDL_UnlockMutex(rewind_lock);
+
+    PROF_END(PROF_REWIND);
 }
 
-// Removes the most recently pushed state from the rewind buffer
+// Removes the most recently pushed state from the rewind buffer. Only called
+// after wait_for_compression().
 static void pop_state() {
     assert(n_recorded_frames > 0);
+
+    // Step tracked_base[] back to the state below. The pages that change
+    // become dirty, so that load_top_state() picks them up.
+    for (unsigned i = 0; i < n_snapshot_records[rewind_buf_i]; ++i) {
+        Page_record const &record =
+          page_records[(first_page_record[rewind_buf_i] + i) % n_page_records];
+        memcpy(tracked_base[record.mem] + (record.page << dirty_page_shift),
+               record.data, dirty_page_size);
+        dirty_pages[record.mem][record.page] |= DIRTY_REWIND;
+    }
+    page_records_i = first_page_record[rewind_buf_i];
+    n_used_page_records -= n_snapshot_records[rewind_buf_i];
+
+    // Ditto for the rest of the state
+    size_t const start = delta_start[rewind_buf_i], len = delta_len[rewind_buf_i];
+    size_t const first_part = min(len, delta_buf_size - start);
+    memcpy(decode_buf, delta_buf + start, first_part);
+    memcpy(decode_buf + first_part, delta_buf, len - first_part);
+    apply_delta(top_raw, decode_buf, len);
+    delta_buf_i = start;
+    n_used_delta_bytes -= len;
+
     rewind_buf_i = (rewind_buf_i == 0) ? n_rewind_frames - 1 : rewind_buf_i - 1;
     --n_recorded_frames;
 }
 
-// Loads the most recently pushed state from the rewind buffer
+// Loads the most recently pushed state from the rewind buffer. Only called
+// after wait_for_compression().
 static void load_top_state() {
-    transfer_system_state<false, false>(rewind_buf + state_size*rewind_buf_i);
+    transfer_system_state<false, false, true>(top_raw);
+    restore_dirty_pages();
     audio_frame_len = frame_len[rewind_buf_i];
 }
 
@@ -126,34 +470,408 @@ static void handle_backwards_frame() {
 }
 
 void handle_rewind(bool do_rewind) {
+    // Rewinding needs all snapshots compressed. The forwards frame that ends
+    // rewinding doesn't, as nothing is pushed while rewinding.
+    if (do_rewind)
+        wait_for_compression();
+
     if (do_rewind && n_recorded_frames > 0)
         handle_backwards_frame();
     else
         handle_forwards_frame();
 }
 
+//
+// Timeline
+//
+
+// The input for each frame is recorded, along with a full state every
+// keyframe_interval frames. seek() uses these to get to any recorded frame.
+//
+// Keyframes are compressed against the previous keyframe, except for every
+// n_keyframes_per_group'th one, which is compressed against zeros. That keeps
+// the number of keyframes that need to be decoded during seeking low.
+
+unsigned const      n_timeline_hours      = 4;
+unsigned const      max_timeline_frames   = 60*60*60*n_timeline_hours;
+unsigned const      keyframe_interval     = 600;
+unsigned const      max_keyframes         = max_timeline_frames/keyframe_interval;
+unsigned const      n_keyframes_per_group = 16;
+
+struct Frame_input {
+    uint8_t buttons[2];
+    bool    reset;
+};
+
+// frame_inputs[n] is the input used during frame n
+static Frame_input *frame_inputs;
+static unsigned     n_timeline_frames;
+
+// keyframes[n] is the state at the beginning of frame n*keyframe_interval
+static uint8_t     *keyframes[max_keyframes];
+static size_t       keyframe_len[max_keyframes];
+static unsigned     n_keyframes;
+static uint8_t     *keyframe_buf;
+static uint8_t     *keyframe_ref;
+static uint8_t     *keyframe_delta;
+
+bool                seeking;
+static unsigned     seek_target;
+
+// Removes keyframes n and up
+static void drop_keyframes(unsigned n) {
+    for (; n_keyframes > n; --n_keyframes)
+        free_array_set_null(keyframes[n_keyframes - 1]);
+}
+
+static void reset_timeline() {
+    timeline_frame = n_timeline_frames = 0;
+    drop_keyframes(0);
+}
+
+static void decode_keyframe(unsigned n, uint8_t *buf) {
+    memset(buf, 0, state_size);
+    for (unsigned i = n - n%n_keyframes_per_group; i <= n; ++i)
+        apply_delta(buf, keyframes[i], keyframe_len[i]);
+}
+
+static void add_keyframe() {
+    if (n_keyframes % n_keyframes_per_group == 0)
+        memset(keyframe_ref, 0, state_size);
+    else
+        decode_keyframe(n_keyframes - 1, keyframe_ref);
+
+    transfer_system_state<false, true, false>(keyframe_buf);
+    size_t const len =
+      encode_delta(keyframe_buf, keyframe_ref, state_size, keyframe_delta);
+
+    fail_if(!(keyframes[n_keyframes] = new (std::nothrow) uint8_t[len]),
+      "failed to allocate %zu-byte keyframe", len);
+    memcpy(keyframes[n_keyframes], keyframe_delta, len);
+    keyframe_len[n_keyframes++] = len;
+}
+
+void record_frame() {
+    // The first frame of a new timeline is frame 0
+    if (n_timeline_frames > 0)
+        ++timeline_frame;
+    if (timeline_frame >= max_timeline_frames)
+        // Timeline full
+        return;
+
+    // Recording a frame drops any later frames, e.g. ones rewound past
+    n_timeline_frames = timeline_frame + 1;
+    drop_keyframes((timeline_frame + keyframe_interval - 1)/keyframe_interval);
+
+    Frame_input &input = frame_inputs[timeline_frame];
+    input.buttons[0] = get_button_states(0);
+    input.buttons[1] = get_button_states(1);
+    input.reset      = reset_pushed;
+
+    if (timeline_frame % keyframe_interval == 0)
+        add_keyframe();
+}
+
+void replay_frame() {
+    assert(seeking);
+
+    Frame_input const &input = frame_inputs[++timeline_frame];
+    set_button_states(0, input.buttons[0]);
+    set_button_states(1, input.buttons[1]);
+    reset_pushed = input.reset;
+
+    // Keep rewind working from the seeked-to frame
+    push_state();
+    if (reset_pushed)
+        soft_reset();
+
+    if (timeline_frame == seek_target)
+        seeking = false;
+}
+
+bool seek(unsigned frame) {
+    if (frame >= n_timeline_frames)
+        return false;
+
+    clear_rewind();
+    decode_keyframe(frame/keyframe_interval, keyframe_buf);
+    transfer_system_state<false, false, false>(keyframe_buf);
+    is_backwards_frame = false;
+
+    seek_target = frame;
+    seeking = timeline_frame != frame;
+
+    return true;
+}
+
+static void init_timeline() {
+    fail_if(!(frame_inputs = new (std::nothrow) Frame_input[max_timeline_frames]),
+      "failed to allocate %zu-byte timeline input buffer",
+      sizeof(Frame_input)*max_timeline_frames);
+    fail_if(!(keyframe_buf   = new (std::nothrow) uint8_t[state_size]) ||
+            !(keyframe_ref   = new (std::nothrow) uint8_t[state_size]) ||
+            !(keyframe_delta = new (std::nothrow) uint8_t[max_delta_len(state_size)]),
+      "failed to allocate timeline keyframe buffers");
+
+    reset_timeline();
+    seeking = false;
+}
+
+static void deinit_timeline() {
+    drop_keyframes(0);
+    free_array_set_null(frame_inputs);
+    free_array_set_null(keyframe_buf);
+    free_array_set_null(keyframe_ref);
+    free_array_set_null(keyframe_delta);
+}
+
+//
+// Snapshot tree
+//
+
+// Reference-counted copy of one page of a tracked memory area
+struct Page_block {
+    unsigned refcount;
+    uint8_t  data[dirty_page_size];
+};
+
+struct Snapshot {
+    unsigned     refcount;
+    // The state apart from the tracked memory areas
+    uint8_t     *state;
+    Page_block **pages[N_TRACKED_MEMS];
+};
+
+// The snapshot the running state was last taken as or restored from. The
+// tracked memory only differs from its pages in pages with DIRTY_SNAPSHOT set.
+// Holds a reference.
+static Snapshot *origin;
+
+static void release_snapshot(Snapshot *snapshot) {
+    if (--snapshot->refcount > 0)
+        return;
+
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem) {
+        for (unsigned page = 0; page < n_pages(mem); ++page)
+            if (--snapshot->pages[mem][page]->refcount == 0)
+                delete snapshot->pages[mem][page];
+        free_array_set_null(snapshot->pages[mem]);
+    }
+    free_array_set_null(snapshot->state);
+    delete snapshot;
+}
+
+static void set_origin(Snapshot *snapshot) {
+    ++snapshot->refcount;
+    if (origin)
+        release_snapshot(origin);
+    origin = snapshot;
+}
+
+Snapshot *take_snapshot() {
+    Snapshot *const snapshot = new (std::nothrow) Snapshot;
+    fail_if(!snapshot, "failed to allocate snapshot");
+    // For the caller
+    snapshot->refcount = 1;
+
+    fail_if(!(snapshot->state = new (std::nothrow) uint8_t[snapshot_size]),
+      "failed to allocate %zu-byte snapshot", snapshot_size);
+    transfer_system_state<false, true, true>(snapshot->state);
+
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem) {
+        fail_if(!(snapshot->pages[mem] = new (std::nothrow) Page_block*[n_pages(mem)]),
+          "failed to allocate snapshot page table");
+
+        for (unsigned page = 0; page < n_pages(mem); ++page) {
+            Page_block *block;
+            if (origin && !(dirty_pages[mem][page] & DIRTY_SNAPSHOT))
+                // Unchanged. Share it.
+                block = origin->pages[mem][page];
+            else {
+                fail_if(!(block = new (std::nothrow) Page_block),
+                  "failed to allocate snapshot page");
+                block->refcount = 0;
+                memcpy(block->data,
+                       tracked_mem[mem] + (page << dirty_page_shift),
+                       dirty_page_size);
+                dirty_pages[mem][page] &= ~DIRTY_SNAPSHOT;
+            }
+            ++block->refcount;
+            snapshot->pages[mem][page] = block;
+        }
+    }
+
+    set_origin(snapshot);
+
+    return snapshot;
+}
+
+void restore_snapshot(Snapshot *snapshot) {
+    clear_rewind();
+    seeking = false;
+
+    transfer_system_state<false, false, true>(snapshot->state);
+
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        for (unsigned page = 0; page < n_pages(mem); ++page) {
+            Page_block *const block = snapshot->pages[mem][page];
+            if (origin && origin->pages[mem][page] == block &&
+                !(dirty_pages[mem][page] & DIRTY_SNAPSHOT))
+                // Already up to date
+                continue;
+
+            size_t const offset = page << dirty_page_shift;
+            memcpy(tracked_mem[mem] + offset, block->data, dirty_page_size);
+            if (mem == CHR_RAM_MEM)
+                decode_chr(offset, dirty_page_size);
+            // Not in tracked_base[] for rewind
+            dirty_pages[mem][page] = DIRTY_REWIND;
+        }
+
+    set_origin(snapshot);
+
+    // The snapshot might not be from the current timeline
+    reset_timeline();
+}
+
+void free_snapshot(Snapshot *snapshot) {
+    release_snapshot(snapshot);
+}
+
+static void init_tracked_mem() {
+    tracked_mem[PRG_RAM_MEM]     = prg_ram_base;
+    tracked_mem_len[PRG_RAM_MEM] = prg_ram_base ? 0x2000*prg_ram_8k_banks : 0;
+    tracked_mem[CHR_RAM_MEM]     = uses_chr_ram ? chr_base : 0;
+    tracked_mem_len[CHR_RAM_MEM] = uses_chr_ram ? 0x2000*chr_8k_banks : 0;
+    tracked_mem[CIRAM_MEM]       = ciram;
+    tracked_mem_len[CIRAM_MEM]   = mirroring == FOUR_SCREEN ? 0x1000 : 0x800;
+
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem) {
+        fail_if(!(tracked_base[mem] = new (std::nothrow) uint8_t[tracked_mem_len[mem]]),
+          "failed to allocate %zu-byte rewind base", tracked_mem_len[mem]);
+        fail_if(!(dirty_pages[mem] = new (std::nothrow) uint8_t[n_pages(mem)]),
+          "failed to allocate dirty page map");
+    }
+    // tracked_base[] gets initialized by the first push_state()
+    mark_all_dirty();
+}
+
+static void init_compression() {
+    max_snapshot_delta_len = max_delta_len(snapshot_size);
+    // Snapshots typically compress to around a tenth of their size. Rewinding
+    // doesn't go as far back if they compress worse than 1:8.
+    delta_buf_size = max(snapshot_size*n_rewind_frames/8,
+                         (n_raw_slots + 1)*max_snapshot_delta_len);
+
+    for (unsigned i = 0; i < n_raw_slots; ++i)
+        fail_if(!(raw_slots[i] = new (std::nothrow) uint8_t[snapshot_size]),
+          "failed to allocate %zu-byte rewind snapshot", snapshot_size);
+    // Zeroed so that the first snapshot compresses without reading
+    // uninitialized memory
+    fail_if(!(top_raw = alloc_array_init<uint8_t>(snapshot_size, 0)),
+      "failed to allocate %zu-byte rewind snapshot", snapshot_size);
+    fail_if(!(encode_buf = new (std::nothrow) uint8_t[max_snapshot_delta_len]) ||
+            !(decode_buf = new (std::nothrow) uint8_t[max_snapshot_delta_len]),
+      "failed to allocate %zu-byte rewind compression buffers",
+      max_snapshot_delta_len);
+    fail_if(!(delta_buf = new (std::nothrow) uint8_t[delta_buf_size]),
+      "failed to allocate %zu-byte rewind buffer", delta_buf_size);
+    fail_if(!(delta_start = new (std::nothrow) size_t[n_rewind_frames]) ||
+            !(delta_len = new (std::nothrow) size_t[n_rewind_frames]),
+      "failed to allocate rewind snapshot indices");
+
+    first_pending_slot = n_pending_slots = 0;
+    delta_buf_i = n_used_delta_bytes = 0;
+    n_raw_bytes = n_compressed_bytes = 0;
+    exit_compression_thread = false;
+
+    fail_if(!(rewind_lock = SDL_CreateMutex()),
+      "failed to create rewind mutex: %s", SDL_GetError());
+    fail_if(!(slot_pending_cond = SDL_CreateCond()) ||
+            !(slot_done_cond = SDL_CreateCond()),
+      "failed to create rewind condition variables: %s", SDL_GetError());
+    fail_if(!(compression_thread =
+                SDL_CreateThread(compression_thread_fn, "rewind compression", 0)),
+      "failed to create rewind compression thread: %s", SDL_GetError());
+}
+
+static void deinit_compression() {
+    SDL_LockMutex(rewind_lock);
+    exit_compression_thread = true;
+    SDL_CondSignal(slot_pending_cond);
+    SDL_UnlockMutex(rewind_lock);
+    SDL_WaitThread(compression_thread, 0);
+
+#ifndef RUN_TESTS
+    if (n_compressed_bytes > 0)
+        printf("Rewind compression ratio: %.1f\n",
+               double(n_raw_bytes)/n_compressed_bytes);
+#endif
+
+    SDL_DestroyCond(slot_pending_cond);
+    SDL_DestroyCond(slot_done_cond);
+    SDL_DestroyMutex(rewind_lock);
+
+    for (unsigned i = 0; i < n_raw_slots; ++i)
+        free_array_set_null(raw_slots[i]);
+    free_array_set_null(top_raw);
+    free_array_set_null(encode_buf);
+    free_array_set_null(decode_buf);
+    free_array_set_null(delta_buf);
+    free_array_set_null(delta_start);
+    free_array_set_null(delta_len);
+}
+
 void init_save_states_for_rom() {
-    state_size = transfer_system_state<true, false>(0);
-    size_t const rewind_buf_size = state_size*n_rewind_frames;
+    init_tracked_mem();
+
+    unsigned n_tracked_pages = 0;
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem)
+        n_tracked_pages += n_pages(mem);
+    // Room for an average of a quarter of the tracked pages being dirtied
+    // each frame. Rewinding doesn't go as far back if more is written.
+    n_page_records = n_rewind_frames*n_tracked_pages/4;
+
+    state_size = transfer_system_state<true, false, false>(0);
+    snapshot_size = transfer_system_state<true, false, true>(0);
+    init_compression();
+    init_timeline();
 #ifndef RUN_TESTS
     printf("Save state size: %zu bytes\nRewind buffer size: %zu bytes\n",
-           state_size, rewind_buf_size);
+           state_size, delta_buf_size + sizeof(Page_record)*n_page_records);
 #endif
     fail_if(!(state = new (std::nothrow) uint8_t[state_size]),
       "failed to allocate %zu-byte buffer for save state", state_size);
-    fail_if(!(rewind_buf = new (std::nothrow) uint8_t[rewind_buf_size]),
-      "failed to allocate %zu-byte rewind buffer", rewind_buf_size);
+    fail_if(!(page_records = new (std::nothrow) Page_record[n_page_records]),
+      "failed to allocate %zu-byte rewind page buffer",
+      sizeof(Page_record)*n_page_records);
     fail_if(!(frame_len = new (std::nothrow) unsigned[n_rewind_frames]),
       "failed to allocate %zu-byte buffer for frame lengths",
       sizeof(unsigned)*n_rewind_frames);
+    fail_if(!(first_page_record = new (std::nothrow) unsigned[n_rewind_frames]) ||
+            !(n_snapshot_records = new (std::nothrow) unsigned[n_rewind_frames]),
+      "failed to allocate rewind page record indices");
 
     rewind_buf_i = 0;
+    page_records_i = n_used_page_records = 0;
 }
 
 void deinit_save_states_for_rom() {
+    deinit_compression();
+    deinit_timeline();
+    if (origin) {
+        release_snapshot(origin);
+        origin = 0;
+    }
     free_array_set_null(state);
-    free_array_set_null(rewind_buf);
+    free_array_set_null(page_records);
     free_array_set_null(frame_len);
+    free_array_set_null(first_page_record);
+    free_array_set_null(n_snapshot_records);
+    for (unsigned mem = 0; mem < N_TRACKED_MEMS; ++mem) {
+        free_array_set_null(tracked_base[mem]);
+        free_array_set_null(dirty_pages[mem]);
+    }
     n_recorded_frames = 0;
     has_save = false;
 }
@@ -12,3 +12,70 @@ void save_audio_frame_length(unsigned len);
 // audio)
 extern bool is_backwards_frame;
 
+// Timeline of recorded frames, for seeking. Frames are numbered from when the
+// ROM or the most recent save state was loaded.
+
+extern unsigned timeline_frame;
+// True while seek() re-runs frames
+extern bool     seeking;
+
+// Called at the end of each frame, after calculating the input for the next
+// frame. replay_frame() is called instead while seeking.
+void record_frame();
+void replay_frame();
+
+// Loads the nearest keyframe at or before 'frame' and re-runs the frames up to
+// it with the recorded input. The re-run frames are neither shown nor heard,
+// and run as fast as possible. Returns false if 'frame' hasn't been recorded.
+//
+// Must be called between frames from the emulation thread, e.g. from
+// handle_ui_keys(). Playing on normally from the frame replaces the recorded
+// frames after it.
+bool seek(unsigned frame);
+
+// Dirty page tracking. The potentially large memory areas below are split
+// into 256-byte pages, and each write to them marks the page as dirty. Rewind
+// snapshots and snapshot tree nodes only copy the pages dirtied since the
+// previous snapshot. Each of them tracks dirtiness separately, in its own bit.
+
+enum Tracked_mem {
+    PRG_RAM_MEM = 0,
+    CHR_RAM_MEM,
+    CIRAM_MEM,
+
+    N_TRACKED_MEMS
+};
+
+enum {
+    DIRTY_REWIND   = 1 << 0,
+    DIRTY_SNAPSHOT = 1 << 1,
+
+    DIRTY_ALL      = DIRTY_REWIND | DIRTY_SNAPSHOT
+};
+
+unsigned const  dirty_page_shift = 8;
+
+// Length of each area in bytes. Zero if the cart doesn't have it.
+extern size_t   tracked_mem_len[N_TRACKED_MEMS];
+extern uint8_t *dirty_pages[N_TRACKED_MEMS];
+
+// 'offset' is the offset of the written byte within the area
+inline void mark_dirty(Tracked_mem mem, size_t offset) {
+    dirty_pages[mem][offset >> dirty_page_shift] = DIRTY_ALL;
+}
+
+// Snapshot tree, for searches that branch from the same state many times.
+// Snapshots share the pages of the tracked memory areas that haven't changed
+// with the snapshot the running state was last taken as or restored from, so
+// taking and restoring snapshots only copies the pages that differ (along
+// with the rest of the state, which is a few KB).
+//
+// Restoring a snapshot clears rewind and starts a new timeline, like loading
+// a save state. These must be called between frames from the emulation
+// thread, and all snapshots must be freed before the ROM is unloaded.
+
+struct Snapshot;
+
+Snapshot *take_snapshot();
+void      restore_snapshot(Snapshot *snapshot);
+void      free_snapshot(Snapshot *snapshot);
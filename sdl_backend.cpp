@@ -8,6 +8,8 @@
 #endif
 #include "save_states.h"
 #include "sdl_backend.h"
+#include "stats.h"
+#include "timing.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
@@ -42,9 +44,14 @@ static Uint32       *back_buffer;
 
 static SDL_mutex    *frame_lock;
 static SDL_cond     *frame_available_cond;
+// Signalled when the SDL thread is done presenting a frame. Only waited on
+// with vsync pacing.
+static SDL_cond     *frame_presented_cond;
 static bool          ready_to_draw_new_frame;
 static bool          frame_available;
 
+static bool          exit_sdl_thread_loop;
+
 void put_pixel(unsigned x, unsigned y, uint32_t color) {
     assert(x < 256);
     assert(y < 240);
@@ -68,6 +75,15 @@ void draw_frame() {
         swap(back_buffer, front_buffer);
         SDL_CondSignal(frame_available_cond);
     }
+    else
+        count_dropped_frame();
+    SDL_UnlockMutex(frame_lock);
+}
+
+void wait_for_frame_presented() {
+    SDL_LockMutex(frame_lock);
+    while (!ready_to_draw_new_frame && !exit_sdl_thread_loop)
+        SDL_CondWait(frame_presented_cond, frame_lock);
     SDL_UnlockMutex(frame_lock);
 }
 
@@ -75,19 +91,28 @@ void draw_frame() {
 // Audio
 //
 
-Uint16 const             sdl_audio_buffer_size = 2048;
+unsigned                 audio_device_buffer_samples = 2048;
 
 static SDL_AudioDeviceID audio_device_id;
 
 // Audio ring buffer
 // Make room for 1/6'th seconds of delay and round up to the nearest power of
-// two for efficient wrapping
+// two for efficient wrapping. The latency controller in audio.cpp decides how
+// much of it is used.
 static Audio_ring_buffer<GE_POW_2(sample_rate/6)> audio_buf;
 
 double audio_buf_fill_level() {
     return audio_buf.fill_level();
 }
 
+size_t audio_buf_n_samples() {
+    return audio_buf.n_samples();
+}
+
+size_t audio_buf_capacity() {
+    return GE_POW_2(sample_rate/6);
+}
+
 // Un-static to prevent warning
 void print_fill_level() {
     static unsigned count = 0;
@@ -102,10 +127,7 @@ void add_audio_samples(int16_t *samples, size_t n_samples) {
 
     SDL_LockAudioDevice(audio_device_id);
     if (!audio_buf.write_samples(samples, n_samples))
-#ifndef RUN_TESTS
-        puts("overflow!")
-#endif
-        ;
+        count_audio_overflow();
     SDL_UnlockAudioDevice(audio_device_id);
 }
 
@@ -122,11 +144,9 @@ static void sdl_audio_callback(void*, Uint8 *stream, int len) {
 
     //print_fill_level();
 
+    record_audio_fill(audio_buf.fill_level());
     if (!audio_buf.read_samples((int16_t*)stream, len/sizeof(int16_t)))
-#ifndef RUN_TESTS
-        puts("underflow!")
-#endif
-        ;
+        count_audio_underflow();
 }
 
 //
@@ -150,14 +170,17 @@ void handle_ui_keys() {
 
     handle_rewind(keys[SDL_SCANCODE_R]);
 
+    static bool f1_was_pressed;
+    if (keys[SDL_SCANCODE_F1] && !f1_was_pressed)
+        show_stats_overlay = !show_stats_overlay;
+    f1_was_pressed = keys[SDL_SCANCODE_F1];
+
     if (reset_pushed)
         soft_reset();
 
     SDL_UnlockMutex(event_lock);
 }
 
-static bool exit_sdl_thread_loop;
-
 // Protects the 'keys' array from being read while being updated
 SDL_mutex  *event_lock;
 
@@ -176,6 +199,57 @@ static void process_events() {
     SDL_UnlockMutex(event_lock);
 }
 
+// Draws the most recent frame start deltas as a bar graph along the bottom of
+// the window, with a line at the target frame length, and the audio buffer
+// fill level as a bar along the top
+static void draw_stats_overlay() {
+    int const width  = scale_factor*256;
+    int const height = scale_factor*240;
+    int const bar_width = width/n_recent_frames;
+    // Bar height in pixels per millisecond
+    unsigned const px_per_ms = 6;
+    uint32_t const target_micros = nanos_per_frame/1000;
+
+    uint32_t deltas[n_recent_frames];
+    get_recent_frame_deltas(deltas);
+
+    SDL_Rect rect;
+    for (unsigned i = 0; i < n_recent_frames; ++i) {
+        if (deltas[i] == 0)
+            // Not enough frames yet
+            continue;
+
+        // Green within 1 ms of the target, yellow within 4 ms, red beyond
+        uint32_t const off = deltas[i] > target_micros ?
+          deltas[i] - target_micros : target_micros - deltas[i];
+        if (off < 1000)
+            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+        else if (off < 4000)
+            SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+        else
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+
+        rect.h = min(px_per_ms*deltas[i]/1000, (unsigned)height/2);
+        rect.x = i*bar_width;
+        rect.y = height - rect.h;
+        rect.w = bar_width - 1;
+        SDL_RenderFillRect(renderer, &rect);
+    }
+
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    rect.x = 0;
+    rect.y = height - px_per_ms*target_micros/1000;
+    rect.w = width;
+    rect.h = 1;
+    SDL_RenderFillRect(renderer, &rect);
+
+    SDL_SetRenderDrawColor(renderer, 0, 128, 255, 255);
+    rect.y = 0;
+    rect.w = audio_buf_fill_level()*width;
+    rect.h = 2*scale_factor;
+    SDL_RenderFillRect(renderer, &rect);
+}
+
 void sdl_thread_loop() {
     for (;;) {
 
@@ -183,6 +257,7 @@ void sdl_thread_loop() {
 
         SDL_LockMutex(frame_lock);
         ready_to_draw_new_frame = true;
+        SDL_CondSignal(frame_presented_cond);
         while (!frame_available && !exit_sdl_thread_loop)
             SDL_CondWait(frame_available_cond, frame_lock);
         if (exit_sdl_thread_loop) {
@@ -199,11 +274,15 @@ void sdl_thread_loop() {
 
         // Draw the new frame
 
+        uint64_t const present_start = monotonic_micros();
         fail_if(SDL_UpdateTexture(screen_tex, 0, front_buffer, 256*sizeof(Uint32)),
           "failed to update screen texture: %s", SDL_GetError());
         fail_if(SDL_RenderCopy(renderer, screen_tex, 0, 0),
           "failed to copy rendered frame to render target: %s", SDL_GetError());
+        if (show_stats_overlay)
+            draw_stats_overlay();
         SDL_RenderPresent(renderer);
+        record_timing(HIST_PRESENT, monotonic_micros() - present_start);
     }
 }
 
@@ -212,6 +291,7 @@ void exit_sdl_thread() {
     SDL_LockMutex(frame_lock);
     exit_sdl_thread_loop = true;
     SDL_CondSignal(frame_available_cond);
+    SDL_CondSignal(frame_presented_cond);
     SDL_UnlockMutex(frame_lock);
 }
 
@@ -243,14 +323,24 @@ void init_sdl() {
         0)),
       "failed to create window: %s", SDL_GetError());
 
-    fail_if(!(renderer = SDL_CreateRenderer(screen, -1, 0)),
+    fail_if(!(renderer = SDL_CreateRenderer(screen, -1,
+                                            vsync_pacing ? SDL_RENDERER_PRESENTVSYNC : 0)),
       "failed to create rendering context: %s", SDL_GetError());
 
     // Display some information about the renderer
     SDL_RendererInfo renderer_info;
-    if (SDL_GetRendererInfo(renderer, &renderer_info))
+    if (SDL_GetRendererInfo(renderer, &renderer_info)) {
         puts("Failed to get renderer information from SDL");
+        if (vsync_pacing) {
+            puts("warning: can't tell if vsync is available - using timer pacing");
+            vsync_pacing = false;
+        }
+    }
     else {
+        if (vsync_pacing && !(renderer_info.flags & SDL_RENDERER_PRESENTVSYNC)) {
+            puts("warning: renderer doesn't support vsync - using timer pacing");
+            vsync_pacing = false;
+        }
         if (renderer_info.name)
             printf("renderer: uses renderer \"%s\"\n", renderer_info.name);
         if (renderer_info.flags & SDL_RENDERER_SOFTWARE)
@@ -286,15 +376,20 @@ void init_sdl() {
 
     // Audio
 
-    SDL_AudioSpec want = {};
+    SDL_AudioSpec want = {}, have;
     want.freq     = sample_rate;
     want.format   = AUDIO_S16SYS;
     want.channels = 1;
-    want.samples  = sdl_audio_buffer_size;
+    want.samples  = audio_device_buffer_samples;
     want.callback = sdl_audio_callback;
 
-    fail_if(!(audio_device_id = SDL_OpenAudioDevice(0, 0, &want, 0, 0)),
+    fail_if(!(audio_device_id = SDL_OpenAudioDevice(0, 0, &want, &have, 0)),
       "failed to initialize audio: %s\n", SDL_GetError());
+    if (have.samples != want.samples) {
+        printf("audio: got a device buffer of %u samples instead of %u\n",
+               have.samples, want.samples);
+        audio_device_buffer_samples = have.samples;
+    }
 
     // Input
 
@@ -320,6 +415,8 @@ void init_sdl() {
       "failed to create frame mutex: %s", SDL_GetError());
     fail_if(!(frame_available_cond = SDL_CreateCond()),
       "failed to create frame condition variable: %s", SDL_GetError());
+    fail_if(!(frame_presented_cond = SDL_CreateCond()),
+      "failed to create frame condition variable: %s", SDL_GetError());
 }
 
 void deinit_sdl() {
@@ -330,6 +427,7 @@ void deinit_sdl() {
 
     SDL_DestroyMutex(frame_lock);
     SDL_DestroyCond(frame_available_cond);
+    SDL_DestroyCond(frame_presented_cond);
 
     SDL_CloseAudioDevice(audio_device_id); // Prolly not needed, but play it safe
     SDL_Quit();
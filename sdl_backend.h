@@ -15,16 +15,27 @@ void exit_sdl_thread();
 
 void put_pixel(unsigned x, unsigned y, uint32_t color);
 void draw_frame();
+// Blocks until the SDL thread has presented the previous frame (and is ready
+// for a new one). With vsync, this paces the emulation by the display.
+void wait_for_frame_presented();
 
 // Audio
 
 double audio_buf_fill_level();
+// Number of samples currently in the audio buffer, and the most it can hold
+size_t audio_buf_n_samples();
+size_t audio_buf_capacity();
 void   add_audio_samples(int16_t *samples, size_t n_samples);
 void   start_audio_playback();
 void   stop_audio_playback();
 
 int    const sample_rate = 44100;
 
+// Size of SDL's audio device buffer in samples (a power of two). Set before
+// init_sdl(). Smaller buffers give lower latency but need the audio callback
+// to run more often. Updated to the size actually used.
+extern unsigned audio_device_buffer_samples;
+
 // Input and events
 
 void handle_ui_keys();
@@ -0,0 +1,135 @@
+#include "common.h"
+
+#include "stats.h"
+
+static Pacing_stats stats;
+
+static uint32_t recent_frame_deltas[n_recent_frames];
+// Index of the oldest entry in recent_frame_deltas[]
+static unsigned recent_frame_i;
+
+bool show_stats_overlay;
+
+// Each value has a single writer, so a relaxed load and store is enough, and
+// avoids the locked read-modify-write of an atomic add. The atomics only keep
+// the readers from seeing torn values.
+
+static uint64_t load(uint64_t const &val) {
+    return __atomic_load_n(&val, __ATOMIC_RELAXED);
+}
+
+static void store(uint64_t &val, uint64_t new_val) {
+    __atomic_store_n(&val, new_val, __ATOMIC_RELAXED);
+}
+
+static void bump(uint64_t &val, uint64_t n = 1) {
+    store(val, load(val) + n);
+}
+
+void record_timing(Timing_hist hist, uint64_t micros) {
+    Timing_stats &t = stats.timing[hist];
+    bump(t.buckets[min(micros/timing_bucket_micros, (uint64_t)n_timing_buckets - 1)]);
+    bump(t.n);
+    bump(t.total_micros, micros);
+    if (micros > load(t.max_micros))
+        store(t.max_micros, micros);
+
+    if (hist == HIST_FRAME_DELTA) {
+        __atomic_store_n(&recent_frame_deltas[recent_frame_i],
+                         (uint32_t)min(micros, (uint64_t)UINT32_MAX), __ATOMIC_RELAXED);
+        __atomic_store_n(&recent_frame_i, (recent_frame_i + 1) % n_recent_frames,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+void record_audio_fill(double fill_level) {
+    bump(stats.audio_fill[min((unsigned)(fill_level*n_fill_buckets), n_fill_buckets - 1)]);
+}
+
+void count_audio_underflow() { bump(stats.audio_underflows); }
+void count_audio_overflow()  { bump(stats.audio_overflows);  }
+void count_dropped_frame()   { bump(stats.dropped_frames);   }
+
+uint64_t get_audio_underflows() { return load(stats.audio_underflows); }
+
+// Copies 'n' counters from 'src' to 'dst' (both arrays of uint64_t)
+static void copy_counters(uint64_t *dst, uint64_t const *src, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = load(src[i]);
+}
+
+void get_pacing_stats(Pacing_stats &res) {
+    // Pacing_stats is nothing but uint64_t's
+    copy_counters((uint64_t*)&res, (uint64_t const*)&stats, sizeof stats/sizeof(uint64_t));
+}
+
+void reset_pacing_stats() {
+    for (size_t i = 0; i < sizeof stats/sizeof(uint64_t); ++i)
+        store(((uint64_t*)&stats)[i], 0);
+}
+
+void get_recent_frame_deltas(uint32_t (&micros)[n_recent_frames]) {
+    unsigned const start = __atomic_load_n(&recent_frame_i, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < n_recent_frames; ++i)
+        micros[i] = __atomic_load_n(&recent_frame_deltas[(start + i) % n_recent_frames],
+                                    __ATOMIC_RELAXED);
+}
+
+//
+// Printing
+//
+
+static void format_micros(char *buf, size_t len, uint64_t micros) {
+    if (micros < 1000)
+        snprintf(buf, len, "%" PRIu64 "us", micros);
+    else
+        snprintf(buf, len, "%.2fms", micros/1000.0);
+}
+
+void print_pacing_stats() {
+    static char const *const hist_names[N_TIMING_HISTS] =
+      { "frame delta", "oversleep", "emulate", "present" };
+
+    Pacing_stats s;
+    get_pacing_stats(s);
+
+    for (unsigned hist = 0; hist < N_TIMING_HISTS; ++hist) {
+        Timing_stats const &t = s.timing[hist];
+        if (t.n == 0)
+            continue;
+
+        char avg[16], max_str[16];
+        format_micros(avg, sizeof avg, t.total_micros/t.n);
+        format_micros(max_str, sizeof max_str, t.max_micros);
+        printf("%s: %" PRIu64 " samples, avg %s, max %s\n",
+               hist_names[hist], t.n, avg, max_str);
+
+        for (unsigned i = 0; i < n_timing_buckets; ++i) {
+            if (t.buckets[i] == 0)
+                continue;
+            char low[16], high[16];
+            format_micros(low, sizeof low, i*timing_bucket_micros);
+            if (i == n_timing_buckets - 1)
+                strcpy(high, "");
+            else
+                format_micros(high, sizeof high, (i + 1)*timing_bucket_micros);
+            printf("  %8s - %-8s %8" PRIu64 " (%.1f%%)\n",
+                   low, high, t.buckets[i], 100.0*t.buckets[i]/t.n);
+        }
+    }
+
+    uint64_t n_callbacks = 0;
+    for (unsigned i = 0; i < n_fill_buckets; ++i)
+        n_callbacks += s.audio_fill[i];
+    if (n_callbacks > 0) {
+        printf("audio buffer fill level at callback (%" PRIu64 " callbacks):\n", n_callbacks);
+        for (unsigned i = 0; i < n_fill_buckets; ++i)
+            if (s.audio_fill[i] > 0)
+                printf("  %3u%% - %3u%% %8" PRIu64 " (%.1f%%)\n",
+                       100*i/n_fill_buckets, 100*(i + 1)/n_fill_buckets,
+                       s.audio_fill[i], 100.0*s.audio_fill[i]/n_callbacks);
+    }
+
+    printf("audio underflows: %" PRIu64 ", overflows: %" PRIu64 ", dropped frames: %" PRIu64 "\n",
+           s.audio_underflows, s.audio_overflows, s.dropped_frames);
+}
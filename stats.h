@@ -0,0 +1,64 @@
+// Frame pacing and audio buffering statistics, for quantifying stutter.
+// Updated from the emulation, SDL, and audio threads. Each value has a single
+// writer, and readers may see a snapshot that is slightly out of date.
+
+enum Timing_hist {
+    HIST_FRAME_DELTA, // Time between the starts of consecutive frames
+    HIST_OVERSLEEP,   // How late the frame-pacing sleep wakes up
+    HIST_EMULATE,     // Time spent emulating (not sleeping) per frame
+    HIST_PRESENT,     // Texture upload and present in the SDL thread
+
+    N_TIMING_HISTS
+};
+
+// Bucket i counts values in the range [i*timing_bucket_micros,
+// (i + 1)*timing_bucket_micros). The last bucket also counts anything larger.
+// Fine enough to show sub-millisecond jitter, and covers two NTSC frames.
+unsigned const timing_bucket_micros = 250;
+unsigned const n_timing_buckets     = 136;
+// Audio ring buffer fill level in 10% steps. A full buffer goes in the last
+// bucket.
+unsigned const n_fill_buckets       = 10;
+
+struct Timing_stats {
+    uint64_t buckets[n_timing_buckets];
+    uint64_t n;
+    uint64_t total_micros;
+    uint64_t max_micros;
+};
+
+struct Pacing_stats {
+    Timing_stats timing[N_TIMING_HISTS];
+    // Sampled at each audio callback
+    uint64_t     audio_fill[n_fill_buckets];
+    uint64_t     audio_underflows;
+    uint64_t     audio_overflows;
+    // Frames dropped because the SDL thread was still presenting the previous
+    // one
+    uint64_t     dropped_frames;
+};
+
+void record_timing(Timing_hist hist, uint64_t micros);
+void record_audio_fill(double fill_level);
+void count_audio_underflow();
+void count_audio_overflow();
+void count_dropped_frame();
+
+// Total number of audio underflows so far. Used by the audio latency
+// controller.
+uint64_t get_audio_underflows();
+
+void get_pacing_stats(Pacing_stats &res);
+void reset_pacing_stats();
+// Prints averages, maximums, and non-empty histogram buckets
+void print_pacing_stats();
+
+// Frame start deltas for the most recent frames, for the overlay
+
+unsigned const n_recent_frames = 128;
+
+// Fills 'micros' with the most recent frame start deltas, oldest first
+void get_recent_frame_deltas(uint32_t (&micros)[n_recent_frames]);
+
+// Toggled with F1. Read by the SDL thread.
+extern bool show_stats_overlay;
@@ -1,8 +1,12 @@
 #include "common.h"
 
 #include "rom.h"
+#include "sdl_backend.h"
+#include "stats.h"
 #include "timing.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
 
 unsigned long const ntsc_master_clock_rate = 21477272;
@@ -17,7 +21,7 @@ unsigned long const pal_nanos_per_frame    = 1000000000/(pal_ppu_clock_rate/(341
 
 unsigned long cpu_clock_rate;
 unsigned long ppu_clock_rate;
-static unsigned long nanos_per_frame;
+unsigned long nanos_per_frame;
 
 void init_timing_for_rom() {
     if (is_pal) {
@@ -35,27 +39,181 @@ void init_timing_for_rom() {
 // SDL's timing functions only have millisecond precision, which doesn't seem
 // good enough (60 FPS is approx. 16 ms per frame). Roll our own.
 
-// Used for main loop synchronization
-static timespec clock_previous;
+static uint64_t monotonic_nanos() {
+    timespec ts;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1,
+      "failed to fetch timestamp from clock_gettime()");
+    return 1000000000*(uint64_t)ts.tv_sec + ts.tv_nsec;
+}
+
+uint64_t monotonic_micros() {
+    return monotonic_nanos()/1000;
+}
+
+//
+// Frame pacing
+//
+// The schedule is absolute: each frame deadline is the previous one plus the
+// frame length, independent of when we actually woke up, so that oversleep
+// doesn't accumulate. clock_nanosleep() can wake up anything from tens of
+// microseconds to milliseconds late depending on the kernel and load, so we
+// only sleep until spin_margin_micros before the deadline and spin for the
+// rest.
+//
+
+unsigned spin_margin_micros = 1000;
+int      pin_to_cpu = -1;
+bool     use_realtime_priority;
+bool     vsync_pacing;
+
+double   frame_len_ratio = 1.0;
+
+// If we fall further behind the schedule than this (after a stall, or after
+// seeking, which doesn't sleep), start a new schedule from the current time
+// instead of running frames back-to-back to catch up
+unsigned const max_lag_frames = 3;
+
+// Deadline for the end of the current frame in nanoseconds
+static uint64_t frame_deadline;
+// When the previous frame started (when the sleep before it ended) in
+// nanoseconds. Zero before the first frame.
+static uint64_t prev_frame_start;
+
+static void configure_emulation_thread() {
+    if (pin_to_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(pin_to_cpu, &cpus);
+        int const res = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+        if (res != 0)
+            printf("warning: failed to pin emulation thread to CPU %d: %s\n",
+                   pin_to_cpu, strerror(res));
+    }
 
-static void add_to_timespec(timespec &ts, long nano_secs) {
-    long const new_nanos = ts.tv_nsec + nano_secs;
-    ts.tv_sec += new_nanos/1000000000l;
-    ts.tv_nsec = new_nanos%1000000000l;
+    if (use_realtime_priority) {
+        sched_param param;
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+        // Usually needs CAP_SYS_NICE or a non-zero RLIMIT_RTPRIO. Carry on
+        // with normal scheduling if not permitted.
+        int const res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (res != 0)
+            printf("warning: failed to give emulation thread SCHED_FIFO priority: %s\n",
+                   strerror(res));
+    }
+}
+
+//
+// Vsync pacing
+//
+// Instead of sleeping, we wait for the SDL thread to present the previous
+// frame, which blocks until vblank. The display refresh period is measured
+// over windows of refresh_window_frames frames and used to set
+// frame_len_ratio.
+//
+
+unsigned const refresh_window_frames = 120;
+// Fall back on timer-based pacing if the display refresh rate differs from the
+// emulated frame rate by more than this. Keeps the speed difference well
+// within what the audio rate adjustment in audio.cpp can absorb.
+double const   max_refresh_mismatch  = 0.01;
+
+// Sum of the frame lengths in the current window in nanoseconds, ignoring
+// missed vblanks and other outliers
+static uint64_t window_total;
+static unsigned window_n_frames;
+static unsigned window_n_outliers;
+
+static void start_refresh_window() {
+    window_total = 0;
+    window_n_frames = window_n_outliers = 0;
+}
+
+static void measure_refresh(uint64_t frame_start) {
+    if (prev_frame_start == 0)
+        return;
+
+    uint64_t const frame_len = frame_start - prev_frame_start;
+    if (2*frame_len > nanos_per_frame && 2*frame_len < 3*nanos_per_frame) {
+        window_total += frame_len;
+        ++window_n_frames;
+    }
+    else
+        ++window_n_outliers;
+
+    if (window_n_frames + window_n_outliers < refresh_window_frames)
+        return;
+
+    double const ratio = window_n_frames > 0 ?
+      (double)window_total/window_n_frames/nanos_per_frame : 0;
+    if (window_n_outliers > refresh_window_frames/2 ||
+        ratio < 1.0 - max_refresh_mismatch || ratio > 1.0 + max_refresh_mismatch) {
+        printf("warning: display refresh rate (%.3f Hz) too far from emulated "
+               "frame rate (%.3f Hz) for vsync pacing - falling back to timer "
+               "pacing\n",
+               ratio > 0 ? 1e9/(ratio*nanos_per_frame) : 0.0, 1e9/nanos_per_frame);
+        vsync_pacing = false;
+        frame_len_ratio = 1.0;
+        frame_deadline = frame_start;
+        return;
+    }
+
+    frame_len_ratio = ratio;
+    start_refresh_window();
 }
 
 void init_timing() {
-    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1,
-      "failed to fetch initial synchronization timestamp from clock_gettime()");
+    configure_emulation_thread();
+    frame_deadline = monotonic_nanos();
+    prev_frame_start = 0;
+    frame_len_ratio = 1.0;
+    start_refresh_window();
+}
+
+// Sleeps and spins until the current frame deadline. Returns the time at which
+// the deadline was reached.
+static uint64_t wait_for_deadline(uint64_t sleep_start) {
+    frame_deadline += nanos_per_frame;
+    if (sleep_start > frame_deadline + max_lag_frames*nanos_per_frame)
+        frame_deadline = sleep_start;
+
+    uint64_t const spin_margin = 1000*(uint64_t)spin_margin_micros;
+    if (frame_deadline > sleep_start + spin_margin) {
+        uint64_t const wake_time = frame_deadline - spin_margin;
+        timespec ts;
+        ts.tv_sec  = wake_time/1000000000;
+        ts.tv_nsec = wake_time%1000000000;
+        int res;
+        while ((res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0)) == EINTR);
+        errno_val_fail_if(res != 0, res, "failed to sleep with clock_nanosleep()");
+    }
+
+    // Spin until the deadline. Yield while there's still a bit of time left,
+    // in case another thread wants the core.
+    uint64_t now;
+    while ((now = monotonic_nanos()) < frame_deadline)
+        if (frame_deadline - now > 50000)
+            sched_yield();
+
+    record_timing(HIST_OVERSLEEP, (now - frame_deadline)/1000);
+
+    return now;
 }
 
 void sleep_till_end_of_frame() {
-    add_to_timespec(clock_previous, nanos_per_frame);
-again:
-    int const res =
-      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &clock_previous, 0);
-    if (res == EINTR) goto again;
-    errno_val_fail_if(res != 0, res, "failed to sleep with clock_nanosleep()");
-    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1,
-      "failed to fetch synchronization timestamp from clock_gettime()");
+    uint64_t const sleep_start = monotonic_nanos();
+
+    uint64_t frame_start;
+    if (vsync_pacing) {
+        wait_for_frame_presented();
+        frame_start = monotonic_nanos();
+        measure_refresh(frame_start);
+    }
+    else
+        frame_start = wait_for_deadline(sleep_start);
+
+    if (prev_frame_start != 0) {
+        record_timing(HIST_FRAME_DELTA, (frame_start - prev_frame_start)/1000);
+        record_timing(HIST_EMULATE, (sleep_start - prev_frame_start)/1000);
+    }
+    prev_frame_start = frame_start;
 }
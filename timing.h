@@ -1,9 +1,34 @@
+// Called from the emulation thread. Applies the thread settings below and
+// starts the frame schedule.
 void init_timing();
 void init_timing_for_rom();
 void sleep_till_end_of_frame();
 
+// Frame pacing settings. Set before init_timing().
+
+// How long before the end of the frame to stop sleeping and start spinning.
+// Higher values give more precise frame starts but burn more CPU.
+extern unsigned spin_margin_micros;
+// CPU to pin the emulation thread to, or -1 for no pinning
+extern int      pin_to_cpu;
+// If true, the emulation thread tries to switch to SCHED_FIFO
+extern bool     use_realtime_priority;
+// If true, frames are paced by the display's vertical sync instead of a timer,
+// with the audio resampling rate adjusted to make up for the difference. Set
+// false if vsync turns out to be unavailable or the refresh rate is too far
+// off.
+extern bool     vsync_pacing;
+
+// With vsync pacing, the measured length of a displayed frame relative to the
+// length of an emulated frame. 1.0 otherwise.
+extern double   frame_len_ratio;
+
+// Current time from CLOCK_MONOTONIC
+uint64_t monotonic_micros();
+
 extern unsigned long cpu_clock_rate;
 extern unsigned long ppu_clock_rate;
+extern unsigned long nanos_per_frame;
 
 // Hack to get a C++03 compile-time constant
 unsigned const      pal_milliframes_per_second = 50007;
@@ -1,5 +1,9 @@
 #include "common.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 bool is_pow_2_or_0(unsigned n) {
     return !(n & (n - 1));
 }
@@ -26,28 +30,40 @@ uint8_t rev_byte(uint8_t n) {
     return rev_table[n];
 }
 
-uint8_t *get_file_buffer(char const *filename, size_t &size_out) {
-    FILE *file;
-    uint8_t *file_buf;
-    long file_size;
-
-    // We do not support large files on 32-bit systems
-
-    errno_fail_if(!(file = fopen(filename, "rb")), "failed to open '%s'", filename);
-    errno_fail_if(fseek(file, 0, SEEK_END) == -1, "failed to seek to end of '%s'", filename);
-    errno_fail_if((file_size = ftell(file)) == -1, "failed to get size of '%s'", filename);
-    errno_fail_if(fseek(file, 0, SEEK_SET) == -1, "failed to seek back to beginning of '%s'", filename);
-
-    fail_if(!(file_buf = new (std::nothrow) unsigned char[file_size]),
-            "failed to allocate %ld-byte buffer for '%s'", file_size, filename);
-    size_t const fread_res = fread(file_buf, 1, file_size, file);
-    if ((unsigned long long)fread_res < (unsigned long long)file_size) {
-        fail_if(feof(file), "unexpected end of file while reading '%s'", filename);
-        fail_if(ferror(file), "I/O error while reading '%s'", filename);
-        fail("unknown error while reading '%s'", filename);
+uint8_t *map_file(char const *filename, size_t &size_out) {
+    int fd;
+    struct stat st;
+    void *map;
+
+    errno_fail_if((fd = open(filename, O_RDONLY)) == -1, "failed to open '%s'", filename);
+    errno_fail_if(fstat(fd, &st) == -1, "failed to get size of '%s'", filename);
+
+    // mmap() rejects zero-length mappings. Let the caller complain about the
+    // file being too short instead.
+    if (st.st_size == 0) {
+        errno_fail_if(close(fd) == -1, "failed to close '%s'", filename);
+        size_out = 0;
+        return 0;
     }
-    errno_fail_if(fclose(file) == EOF, "failed to close '%s'", filename);
 
-    size_out = file_size;
-    return file_buf;
+    // Read-only and private, so that instances mapping the same file share the
+    // pages through the page cache. The mapping stays valid after the
+    // descriptor is closed.
+    errno_fail_if((map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED,
+                  "failed to map '%s'", filename);
+    errno_fail_if(close(fd) == -1, "failed to close '%s'", filename);
+
+    // Just a hint - the whole file will be touched soon (MD5 digest, CHR
+    // decoding), so start reading it in now. Failure is harmless.
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    size_out = st.st_size;
+    return (uint8_t*)map;
+}
+
+void unmap_file(uint8_t *&map, size_t size) {
+    if (map) {
+        errno_fail_if(munmap(map, size) == -1, "failed to unmap file");
+        map = 0;
+    }
 }
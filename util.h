@@ -49,8 +49,12 @@ char (&array_len_helper(T (&)[N]))[N];
 // File functions
 //
 
-// Returns the contents of file 'filename'. Buffer freed by caller.
-uint8_t *get_file_buffer(char const *filename, size_t &size_out);
+// Maps file 'filename' read-only into memory and returns a pointer to the
+// mapping, or null for an empty file. Unmapped by caller with unmap_file().
+uint8_t *map_file(char const *filename, size_t &size_out);
+// Unmaps a mapping returned by map_file() and sets the pointer to null. Safe
+// to call on a null pointer.
+void unmap_file(uint8_t *&map, size_t size);
 
 //
 // Array functions